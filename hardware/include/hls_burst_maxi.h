@@ -14,20 +14,354 @@
 
 #else
 
-#include <list>
 #include <map>
+#include <vector>
+#include <string>
 #include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "ap_int.h"
 
 namespace hls {
 
+/// FIFO of the outstanding requests of a port, in a ring buffer that
+/// doubles when full, so requests do not allocate in the steady state
+template<typename E>
+class MAXIRequestQueue {
+public:
+  MAXIRequestQueue() : Head(0), Count(0) {}
+
+  bool empty() const { return !Count; }
+  size_t size() const { return Count; }
+  E &front() { return Buf[Head]; }
+  E &operator[](size_t i) { return Buf[(Head + i) & (Buf.size() - 1)]; }
+
+  void push_back(const E &e) {
+    if (Count == Buf.size())
+      grow();
+    Buf[(Head + Count++) & (Buf.size() - 1)] = e;
+  }
+
+  void pop_front() {
+    Head = (Head + 1) & (Buf.size() - 1);
+    Count--;
+  }
+
+  void clear() { Head = Count = 0; }
+
+private:
+  std::vector<E> Buf;
+  size_t Head;
+  size_t Count;
+
+  void grow() {
+    std::vector<E> New(Buf.empty() ? 16 : Buf.size() * 2);
+    for (size_t i = 0; i < Count; i++)
+      New[i] = (*this)[i];
+    Buf.swap(New);
+    Head = 0;
+  }
+};
+
+/// Element offsets covered by outstanding requests: each key starts a
+/// range of offsets covered by as many requests as its value, up to the
+/// next key. Adjacent ranges with equal counts are merged, so requests
+/// to consecutive bursts keep the index small, and an overlap check
+/// costs a lookup plus the ranges it spans instead of a scan of the
+/// outstanding requests.
+class MAXIIntervalIndex {
+public:
+  void add(size_t offset, unsigned len) { update(offset, len, 1); }
+  void remove(size_t offset, unsigned len) { update(offset, len, -1); }
+  void clear() { Cover.clear(); }
+
+  bool overlaps(size_t offset, unsigned len) const {
+    size_t end = offset + len;
+    auto It = Cover.upper_bound(offset);
+    if (It != Cover.begin())
+      --It;
+    for (; It != Cover.end() && It->first < end; ++It)
+      if (It->second)
+        return true;
+    return false;
+  }
+
+private:
+  std::map<size_t, unsigned> Cover;
+
+  void update(size_t offset, unsigned len, int delta) {
+    size_t end = offset + len;
+    split(offset);
+    split(end);
+    for (auto It = Cover.find(offset); It->first != end; ++It)
+      It->second += delta;
+    coalesce(offset);
+    coalesce(end);
+  }
+
+  /// Start a range at 'at', with the count of the range containing it
+  void split(size_t at) {
+    auto It = Cover.lower_bound(at);
+    if (It != Cover.end() && It->first == at)
+      return;
+    unsigned count = It == Cover.begin() ? 0 : std::prev(It)->second;
+    Cover.emplace_hint(It, at, count);
+  }
+
+  void coalesce(size_t at) {
+    auto It = Cover.find(at);
+    unsigned prev = It == Cover.begin() ? 0 : std::prev(It)->second;
+    if (It->second == prev)
+      Cover.erase(It);
+  }
+};
+
+/// Optional timing model of the m_axi ports behind hls::burst_maxi,
+/// enabled by the HLS_MAXI_TIMING environment variable (or macro). Its
+/// value is "1" for the defaults, or a comma-separated list of
+/// parameters such as "read_latency=100,width=64,outstanding=32":
+///   read_latency   cycles from a read request to its first data beat
+///   write_latency  cycles from the last data beat to the write response
+///   width          bytes per data beat, 0 for the element size of
+///                  the first pointer of the port
+///   outstanding    transactions in flight per direction
+///   max_burst      beats per AXI transaction
+///   efficiency     fraction of the beats the memory sustains (DDR bank
+///                  conflicts, refresh, read/write turnaround)
+///   mhz            kernel clock, for the bandwidth in GB/s
+/// Requests are split at 4 KB boundaries and at max_burst beats, the
+/// buffer being 4 KB aligned as device buffers are. The model is memory
+/// bound: the kernel issues every request as soon as the port accepts
+/// it. The cycles and the achieved bandwidth of every port are printed
+/// at exit. Pointers sharing a bundle share the port, and each port has
+/// a memory bank of its own: see burst_maxi::set_bundle().
+struct MAXITimingConfig {
+  unsigned read_latency;
+  unsigned write_latency;
+  unsigned width;
+  unsigned outstanding;
+  unsigned max_burst;
+  double efficiency;
+  double mhz;
+
+  MAXITimingConfig()
+    : read_latency(64), write_latency(32), width(0), outstanding(16),
+      max_burst(256), efficiency(0.85), mhz(300) {}
+
+  void parse(const char *s) {
+    std::string list(s);
+    size_t pos = 0;
+    while (pos < list.size()) {
+      size_t end = list.find(',', pos);
+      if (end == std::string::npos)
+        end = list.size();
+      std::string item = list.substr(pos, end - pos);
+      pos = end + 1;
+      size_t eq = item.find('=');
+      if (eq == std::string::npos)
+        continue;
+      std::string key = item.substr(0, eq);
+      double value = atof(item.c_str() + eq + 1);
+      if (key == "read_latency")
+        read_latency = value;
+      else if (key == "write_latency")
+        write_latency = value;
+      else if (key == "width")
+        width = value;
+      else if (key == "outstanding")
+        outstanding = value > 1 ? value : 1;
+      else if (key == "max_burst")
+        max_burst = value > 1 ? value : 1;
+      else if (key == "efficiency")
+        efficiency = value > 0 && value <= 1 ? value : 1;
+      else if (key == "mhz")
+        mhz = value;
+      else
+        std::cout << "WARNING [HLS SIM]: unknown HLS_MAXI_TIMING parameter '"
+                  << key << "'." << std::endl;
+    }
+  }
+};
+
+/// Read or write channel of a modeled m_axi port, times in cycles
+struct MAXIChannelTiming {
+  unsigned long long requests;
+  unsigned long long transactions;
+  unsigned long long beats;
+  unsigned long long bytes;
+  double issue;                 // next cycle the address channel is free
+  double first;                 // first request
+  double last;                  // last data beat or write response
+  MAXIRequestQueue<double> inflight; // completion of each transaction
+
+  MAXIChannelTiming()
+    : requests(0), transactions(0), beats(0), bytes(0), issue(0),
+      first(-1), last(0) {}
+};
+
+/// The read and write channels of a port are independent, but share the
+/// memory behind it, which moves the data of one direction at a time
+struct MAXIPortTiming {
+  std::string name;
+  unsigned elem_bytes;          // bus width if the config gives none
+  double mem_free;              // next cycle the memory is free
+  MAXIChannelTiming rd;
+  MAXIChannelTiming wr;
+
+  MAXIPortTiming() : elem_bytes(0), mem_free(0) {}
+
+  /// Time the request of 'len' elements of 'bytes' bytes at element
+  /// 'offset'. The pointers of a bundle may have different element types.
+  void request(bool write, size_t offset, unsigned len, unsigned bytes);
+};
+
+class MAXITiming {
+public:
+  static bool enabled() {
+    static bool on = init();
+    return on;
+  }
+
+  static const MAXITimingConfig &config() {
+    return get_config();
+  }
+
+  /// Port of the pointer 'p', or of the bundle 'name' if not null
+  static MAXIPortTiming *port(const void *p, const char *name, unsigned elem_bytes) {
+    std::map<std::string, MAXIPortTiming *> &ports = get_ports();
+    std::string key;
+    if (name) {
+      key = name;
+    } else {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%p", p);
+      key = buf;
+    }
+    MAXIPortTiming *&port = ports[key];
+    if (!port) {
+      port = new MAXIPortTiming();
+      port->name = key;
+      port->elem_bytes = elem_bytes;
+      get_order().push_back(port);
+    }
+    return port;
+  }
+
+private:
+  static MAXITimingConfig &get_config() {
+    static MAXITimingConfig *config = new MAXITimingConfig();
+    return *config;
+  }
+
+  static std::map<std::string, MAXIPortTiming *> &get_ports() {
+    static std::map<std::string, MAXIPortTiming *> *ports = new std::map<std::string, MAXIPortTiming *>();
+    return *ports;
+  }
+
+  static std::vector<MAXIPortTiming *> &get_order() {
+    static std::vector<MAXIPortTiming *> *order = new std::vector<MAXIPortTiming *>();
+    return *order;
+  }
+
+  static bool init() {
+    const char *env = getenv("HLS_MAXI_TIMING");
+#ifdef HLS_MAXI_TIMING
+    if (!env)
+      env = HLS_MAXI_TIMING;
+#endif
+    if (!env || !*env || !strcmp(env, "0"))
+      return false;
+    get_config().parse(env);
+    std::atexit(print);
+    return true;
+  }
+
+  static void print_channel(const char *dir, const MAXIChannelTiming &ch) {
+    if (!ch.requests)
+      return;
+    double cycles = ch.last - ch.first;
+    double per_cycle = cycles > 0 ? ch.bytes / cycles : 0;
+    std::cout << "  " << dir << ": " << ch.bytes << " bytes in "
+              << ch.requests << " requests, " << ch.transactions
+              << " transactions, " << ch.beats << " beats, "
+              << (unsigned long long)(cycles + 0.5) << " cycles, "
+              << per_cycle << " bytes/cycle ("
+              << per_cycle * config().mhz / 1000 << " GB/s)" << std::endl;
+  }
+
+  static void print() {
+    for (MAXIPortTiming *p : get_order()) {
+      if (!p->rd.requests && !p->wr.requests)
+        continue;
+      double first = p->rd.first < 0 ? p->wr.first
+                   : p->wr.first < 0 ? p->rd.first
+                   : p->rd.first < p->wr.first ? p->rd.first : p->wr.first;
+      double last = p->rd.last > p->wr.last ? p->rd.last : p->wr.last;
+      std::cout << "INFO [HLS SIM]: m_axi port '" << p->name << "' busy for "
+                << (unsigned long long)(last - first + 0.5) << " cycles at "
+                << config().mhz << " MHz" << std::endl;
+      print_channel("read", p->rd);
+      print_channel("write", p->wr);
+    }
+  }
+};
+
+inline void MAXIPortTiming::request(bool write, size_t offset, unsigned len,
+                                    unsigned bytes) {
+  const MAXITimingConfig &C = MAXITiming::config();
+  MAXIChannelTiming &ch = write ? wr : rd;
+  unsigned width = C.width ? C.width : elem_bytes;
+  size_t addr = offset * bytes;
+  size_t left = (size_t)len * bytes;
+  ch.requests++;
+  ch.bytes += left;
+  while (left) {
+    // A transaction ends at a 4 KB boundary or after max_burst beats
+    size_t room = 4096 - addr % 4096;
+    size_t burst = (size_t)C.max_burst * width - addr % width;
+    size_t n = left < room ? left : room;
+    if (burst < n)
+      n = burst;
+    size_t beats = (addr % width + n + width - 1) / width;
+    // Wait for a free slot among the outstanding transactions
+    double t = ch.issue;
+    if (ch.inflight.size() >= C.outstanding) {
+      if (ch.inflight.front() > t)
+        t = ch.inflight.front();
+      ch.inflight.pop_front();
+    }
+    if (ch.first < 0)
+      ch.first = t;
+    ch.issue = t + 1;
+    double data = beats / C.efficiency;
+    double done;
+    double start = t + (write ? 1 : C.read_latency);
+    if (start < mem_free)
+      start = mem_free;
+    mem_free = start + data;
+    done = write ? mem_free + C.write_latency : mem_free;
+    ch.inflight.push_back(done);
+    if (done > ch.last)
+      ch.last = done;
+    ch.transactions++;
+    ch.beats += beats;
+    addr += n;
+    left -= n;
+  }
+}
+
 struct MAXIAccessRecord {
+  typedef std::pair<size_t, unsigned> Request;
   unsigned read_disp;
   unsigned write_disp;
-  std::list<std::pair<size_t, unsigned>> ReadQ;
-  std::list<std::pair<size_t, unsigned>> WriteQ;
-  std::list<std::pair<size_t, unsigned>> WriteRespQ;
+  MAXIRequestQueue<Request> ReadQ;
+  MAXIRequestQueue<Request> WriteQ;
+  MAXIRequestQueue<Request> WriteRespQ;
+  MAXIIntervalIndex Reads;      // ReadQ
+  MAXIIntervalIndex Writes;     // WriteQ and WriteRespQ
+  MAXIPortTiming *Timing = nullptr; // with HLS_MAXI_TIMING
 };
 
 template<typename T>
@@ -37,63 +371,105 @@ public:
     unsigned bitwidth = sizeof(T) * 8;
     assert(bitwidth != 0 && !(bitwidth & (bitwidth - 1)) &&
            "Error: bit width of hls::burst_maxi is not poower-of-2.");
-    // Reset the MAXI access record to this pointer
-    MAXIAccessRecord &R = getMAXIPointer2AccessRecordMap()[p];
+    // Reset the MAXI access record to this pointer. Copies of this
+    // object, such as the kernel argument, share it.
+    Rec = &getMAXIPointer2AccessRecordMap()[p];
+    MAXIAccessRecord &R = *Rec;
     R.read_disp = 0;
     R.write_disp = 0;
     R.ReadQ.clear();
     R.WriteQ.clear();
     R.WriteRespQ.clear();
+    R.Reads.clear();
+    R.Writes.clear();
+    if (!R.Timing && MAXITiming::enabled())
+      R.Timing = MAXITiming::port(p, 0, sizeof(T));
+  }
+
+  /// Time the accesses through this pointer as part of the m_axi port
+  /// 'bundle', shared with the other pointers of the bundle, when the
+  /// timing model is enabled (see MAXITimingConfig)
+  void set_bundle(const char *bundle) {
+    if (MAXITiming::enabled())
+      Rec->Timing = MAXITiming::port(Ptr, bundle, sizeof(T));
   }
 
   void read_request(size_t offset, unsigned len) {
     assert(len > 0);
-    MAXIAccessRecord &R = getMAXIPointer2AccessRecordMap()[Ptr];
+    MAXIAccessRecord &R = *Rec;
     R.ReadQ.push_back(std::make_pair(offset, len));
-    std::list<std::pair<size_t, unsigned>> CurrentWriteQ = R.WriteQ;
-    CurrentWriteQ.insert(CurrentWriteQ.end(), 
-                         R.WriteRespQ.begin(), R.WriteRespQ.end());
-    for (auto Pair : CurrentWriteQ) {
-      if (overlap(offset, len, Pair.first, Pair.second)) {
-        std::cerr << "Error: MAXI read request(offset = " << offset << ", len = " << len << ") overlaps with previous write request(offset = " << Pair.first << ", len = " << Pair.second << ")." << std::endl;
-        abort();
-      }
+    R.Reads.add(offset, len);
+    if (R.Timing)
+      R.Timing->request(false, offset, len, sizeof(T));
+    if (R.Writes.overlaps(offset, len)) {
+      MAXIAccessRecord::Request Pair = find_overlap(offset, len, R.WriteQ, R.WriteRespQ);
+      std::cerr << "Error: MAXI read request(offset = " << offset << ", len = " << len << ") overlaps with previous write request(offset = " << Pair.first << ", len = " << Pair.second << ")." << std::endl;
+      abort();
     }
   }
 
   T read() {
-    MAXIAccessRecord &R = getMAXIPointer2AccessRecordMap()[Ptr];
+    MAXIAccessRecord &R = *Rec;
     assert(!R.ReadQ.empty() && "Error: MAXI read without request."); 
     auto Pair = R.ReadQ.front();
     T V = Ptr[Pair.first + (R.read_disp++)];
     if (R.read_disp == Pair.second) {
       R.read_disp = 0;
       R.ReadQ.pop_front();
+      R.Reads.remove(Pair.first, Pair.second);
     }
     return V;     
   }
 
+  /// Read the next 'len' elements of the requested bursts into 'dst',
+  /// a whole burst at a time
+  void read_burst(T *dst, size_t len) {
+    MAXIAccessRecord &R = *Rec;
+    while (len) {
+      assert(!R.ReadQ.empty() && "Error: MAXI read without request."); 
+      auto Pair = R.ReadQ.front();
+      size_t n = Pair.second - R.read_disp;
+      if (n > len)
+        n = len;
+      memcpy(dst, &Ptr[Pair.first + R.read_disp], n * sizeof(T));
+      dst += n;
+      len -= n;
+      R.read_disp += n;
+      if (R.read_disp == Pair.second) {
+        R.read_disp = 0;
+        R.ReadQ.pop_front();
+        R.Reads.remove(Pair.first, Pair.second);
+      }
+    }
+  }
+
   void write_request(size_t offset, unsigned len) {
     assert(len > 0);
-    MAXIAccessRecord &R = getMAXIPointer2AccessRecordMap()[Ptr];
-    for (auto Pair : R.ReadQ) {
-      if (overlap(offset, len, Pair.first, Pair.second)) {
-        std::cerr << "Error: MAXI write request(offset = " << offset << ", len = " << len << ") overlaps with previous read request(offset = " << Pair.first << ", len = " << Pair.second << ")." << std::endl;
-        abort();
-      }
+    MAXIAccessRecord &R = *Rec;
+    if (R.Reads.overlaps(offset, len)) {
+      MAXIAccessRecord::Request Pair = find_overlap(offset, len, R.ReadQ, R.ReadQ);
+      std::cerr << "Error: MAXI write request(offset = " << offset << ", len = " << len << ") overlaps with previous read request(offset = " << Pair.first << ", len = " << Pair.second << ")." << std::endl;
+      abort();
     }
     R.WriteQ.push_back(std::make_pair(offset, len));
+    R.Writes.add(offset, len);
+    if (R.Timing)
+      R.Timing->request(true, offset, len, sizeof(T));
   }
 
   void write(const T &val, ap_int<sizeof(T)> byte_enable_mask = -1) {
-    MAXIAccessRecord &R = getMAXIPointer2AccessRecordMap()[Ptr];
+    MAXIAccessRecord &R = *Rec;
     assert(!R.WriteQ.empty() && "Error: MAXI write without request."); 
     auto Pair = R.WriteQ.front();
     T *DstP = &Ptr[Pair.first + R.write_disp++];
-    T Src = val;
-    for (unsigned i = 0; i < sizeof(T); i++) {
-      if (byte_enable_mask[i]) 
-        reinterpret_cast<char *>(DstP)[i] = reinterpret_cast<char *>(&Src)[i];
+    if (byte_enable_mask.and_reduce()) {
+      memcpy(DstP, &val, sizeof(T));
+    } else {
+      T Src = val;
+      for (unsigned i = 0; i < sizeof(T); i++) {
+        if (byte_enable_mask[i]) 
+          reinterpret_cast<char *>(DstP)[i] = reinterpret_cast<char *>(&Src)[i];
+      }
     }
 
     if (R.write_disp == Pair.second) {
@@ -102,18 +478,57 @@ public:
       R.WriteQ.pop_front();
     }   
   }
+
+  /// Write the next 'len' elements of the requested bursts from 'src',
+  /// with every byte enabled, a whole burst at a time
+  void write_burst(const T *src, size_t len) {
+    MAXIAccessRecord &R = *Rec;
+    while (len) {
+      assert(!R.WriteQ.empty() && "Error: MAXI write without request."); 
+      auto Pair = R.WriteQ.front();
+      size_t n = Pair.second - R.write_disp;
+      if (n > len)
+        n = len;
+      memcpy(&Ptr[Pair.first + R.write_disp], src, n * sizeof(T));
+      src += n;
+      len -= n;
+      R.write_disp += n;
+      if (R.write_disp == Pair.second) {
+        R.write_disp = 0;
+        R.WriteRespQ.push_back(Pair);
+        R.WriteQ.pop_front();
+      }
+    }
+  }
  
   void write_response() {
-    MAXIAccessRecord &R = getMAXIPointer2AccessRecordMap()[Ptr];
+    MAXIAccessRecord &R = *Rec;
     assert(!R.WriteRespQ.empty() && "Error: bad MAXI write response. Possible: 1) no corresponding write request; 2) some data still not written.");
+    auto Pair = R.WriteRespQ.front();
     R.WriteRespQ.pop_front();
+    R.Writes.remove(Pair.first, Pair.second);
   }
 
 private:
   T *Ptr;
+  MAXIAccessRecord *Rec;
   bool overlap(size_t a, unsigned a_len, size_t b, unsigned b_len) {
     return a <= b ? a + a_len > b : b + b_len > a;
   }
+
+  /// The first request of Q1 then Q2 overlapping the new one, for the
+  /// error message once the index found there is one
+  MAXIAccessRecord::Request find_overlap(size_t offset, unsigned len,
+                                         MAXIRequestQueue<MAXIAccessRecord::Request> &Q1,
+                                         MAXIRequestQueue<MAXIAccessRecord::Request> &Q2) {
+    for (size_t i = 0; i < Q1.size(); i++)
+      if (overlap(offset, len, Q1[i].first, Q1[i].second))
+        return Q1[i];
+    for (size_t i = 0; i < Q2.size(); i++)
+      if (overlap(offset, len, Q2[i].first, Q2[i].second))
+        return Q2[i];
+    return MAXIAccessRecord::Request(offset, len);
+  }
   static std::map<void *, MAXIAccessRecord> &getMAXIPointer2AccessRecordMap() {
     static std::map<void *, MAXIAccessRecord> *Map = new std::map<void *, MAXIAccessRecord>();
     return *Map;
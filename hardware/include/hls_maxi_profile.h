@@ -0,0 +1,333 @@
+// Copyright 1986-2022 Xilinx, Inc. All Rights Reserved.
+// Copyright 2022-2023 Advanced Micro Devices, Inc. All Rights Reserved.
+
+// 67d7842dbbe25473c3c32b93c0da8047785f30d78e8a024de1b57352245f9689
+#ifndef X_HLS_MAXI_PROFILE_SIM_H
+#define X_HLS_MAXI_PROFILE_SIM_H
+
+/*
+ * This file contains hls::maxi_ptr, an instrumented pointer to profile
+ * the m_axi accesses of a kernel in C simulation
+ */
+#ifndef __cplusplus
+
+#error C++ is required to include this header file
+
+#else
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include "hls_burst_maxi.h"
+
+namespace hls {
+
+/// Access stream of one m_axi bundle, as recorded by maxi_ptr. Bursts
+/// are inferred the way HLS infers them from a loop: consecutive
+/// accesses of one port to consecutive elements, in one direction. An
+/// access of another port of the bundle in the same direction ends the
+/// burst, as interleaved pointers on one bundle do in hardware.
+class maxi_bundle_profile {
+public:
+  enum { HISTOGRAM_BUCKETS = 33 };
+
+  struct channel_stats {
+    unsigned long long accesses;
+    unsigned long long sequential;  // next element of the same port
+    unsigned long long bursts;
+    unsigned long long histogram[HISTOGRAM_BUCKETS]; // bucket i: [2^i, 2^(i+1))
+    int port;                       // port of the open burst, -1 if none
+    unsigned bytes;                 // element size of that port
+    size_t start;
+    size_t len;
+
+    channel_stats() : accesses(0), sequential(0), bursts(0),
+                      histogram(), port(-1), bytes(0), start(0), len(0) {}
+  };
+
+  struct port_stats {
+    std::string name;
+    unsigned bytes;
+    unsigned long long reads;
+    unsigned long long writes;
+    size_t next_read;
+    size_t next_write;
+
+    port_stats(const std::string &n, unsigned b)
+      : name(n), bytes(b), reads(0), writes(0), next_read(-1), next_write(-1) {}
+  };
+
+  /// True when HLS_MAXI_PROFILE is set in the environment, or defined
+  static bool enabled() {
+    static bool on = init();
+    return on;
+  }
+
+  /// The profile of 'bundle', created on first use. A null bundle is
+  /// 'gmem', the default bundle of the m_axi interfaces.
+  static maxi_bundle_profile *get(const char *bundle, unsigned elem_bytes) {
+    if (!bundle)
+      bundle = "gmem";
+    std::lock_guard<std::mutex> lg(get_mutex());
+    std::vector<maxi_bundle_profile *> &all = get_bundles();
+    for (maxi_bundle_profile *b : all)
+      if (b->name == bundle)
+        return b;
+    maxi_bundle_profile *b = new maxi_bundle_profile(bundle, elem_bytes);
+    all.push_back(b);
+    return b;
+  }
+
+  /// Index of the port 'port', added if the bundle does not have it yet.
+  /// An unnamed port is a new one.
+  int add_port(const char *port, unsigned bytes) {
+    std::lock_guard<std::mutex> lg(mutex);
+    if (port)
+      for (size_t i = 0; i < ports.size(); i++)
+        if (ports[i].name == port)
+          return i;
+    std::string n = port ? port : "port" + std::to_string(ports.size());
+    ports.push_back(port_stats(n, bytes));
+    return ports.size() - 1;
+  }
+
+  void access(int port, bool write, size_t index) {
+    std::lock_guard<std::mutex> lg(mutex);
+    port_stats &p = ports[port];
+    channel_stats &ch = write ? wr : rd;
+    size_t &next = write ? p.next_write : p.next_read;
+    (write ? p.writes : p.reads)++;
+    ch.accesses++;
+    if (index == next)
+      ch.sequential++;
+    next = index + 1;
+    // Port switches of the bundle, whatever the directions
+    if (last_port >= 0 && last_port != port)
+      switches++;
+    last_port = port;
+    if (ch.port == port && index == ch.start + ch.len) {
+      ch.len++;
+      return;
+    }
+    end_burst(write);
+    ch.port = port;
+    ch.bytes = p.bytes;
+    ch.start = index;
+    ch.len = 1;
+  }
+
+private:
+  std::string name;
+  std::vector<port_stats> ports;
+  channel_stats rd;
+  channel_stats wr;
+  unsigned long long switches;      // port differs from the previous access
+  int last_port;
+  // The inferred bursts go through the m_axi timing model of
+  // hls_burst_maxi.h, with the parameters of HLS_MAXI_TIMING
+  MAXIPortTiming timing;
+  std::mutex mutex;
+
+  maxi_bundle_profile(const char *n, unsigned elem_bytes)
+    : name(n), switches(0), last_port(-1) {
+    timing.name = n;
+    timing.elem_bytes = elem_bytes;
+  }
+
+  void end_burst(bool write) {
+    channel_stats &ch = write ? wr : rd;
+    if (!ch.len)
+      return;
+    unsigned b = 0;
+    while (b + 1 < HISTOGRAM_BUCKETS && (size_t)2 << b <= ch.len)
+      b++;
+    ch.histogram[b]++;
+    ch.bursts++;
+    timing.request(write, ch.start, ch.len, ch.bytes);
+    ch.len = 0;
+    ch.port = -1;
+  }
+
+  static std::mutex &get_mutex() {
+    static std::mutex *mutex = new std::mutex();
+    return *mutex;
+  }
+
+  static std::vector<maxi_bundle_profile *> &get_bundles() {
+    static std::vector<maxi_bundle_profile *> *bundles = new std::vector<maxi_bundle_profile *>();
+    return *bundles;
+  }
+
+  static bool init() {
+    const char *env = getenv("HLS_MAXI_PROFILE");
+#ifdef HLS_MAXI_PROFILE
+    if (!env)
+      env = "1";
+#endif
+    if (!env || !*env || !strcmp(env, "0"))
+      return false;
+    // Parses the timing parameters given in HLS_MAXI_TIMING, if any
+    MAXITiming::enabled();
+    std::atexit(print);
+    return true;
+  }
+
+  static double percent(unsigned long long n, unsigned long long total) {
+    return total ? 100.0 * n / total : 0;
+  }
+
+  static void print_channel(const char *dir, const channel_stats &ch) {
+    if (!ch.accesses)
+      return;
+    std::cout << "  " << dir << ": " << ch.accesses << " accesses, "
+              << percent(ch.sequential, ch.accesses) << "% sequential, "
+              << ch.bursts << " bursts of " << (double)ch.accesses / ch.bursts
+              << " on average" << std::endl;
+    std::cout << "    burst lengths:";
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      if (!ch.histogram[i])
+        continue;
+      unsigned long long lo = 1ULL << i;
+      std::cout << " [" << lo;
+      if (lo > 1)
+        std::cout << "-" << lo * 2 - 1;
+      std::cout << "]: " << ch.histogram[i];
+    }
+    std::cout << std::endl;
+  }
+
+  static void print() {
+    std::lock_guard<std::mutex> lg(get_mutex());
+    for (maxi_bundle_profile *b : get_bundles()) {
+      std::lock_guard<std::mutex> blg(b->mutex);
+      b->end_burst(false);
+      b->end_burst(true);
+      std::cout << "INFO [HLS SIM]: m_axi bundle '" << b->name << "', ports";
+      for (port_stats &p : b->ports)
+        std::cout << " '" << p.name << "' (" << p.reads << " reads, "
+                  << p.writes << " writes)";
+      std::cout << std::endl;
+      std::cout << "  " << percent(b->switches, b->rd.accesses + b->wr.accesses)
+                << "% port switches" << std::endl;
+      print_channel("read", b->rd);
+      print_channel("write", b->wr);
+      // Bytes moved against the peak of one beat per cycle
+      const MAXITimingConfig &C = MAXITiming::config();
+      const MAXIPortTiming &t = b->timing;
+      unsigned width = C.width ? C.width : t.elem_bytes;
+      double first = t.rd.first < 0 ? t.wr.first
+                   : t.wr.first < 0 ? t.rd.first
+                   : t.rd.first < t.wr.first ? t.rd.first : t.wr.first;
+      double last = t.rd.last > t.wr.last ? t.rd.last : t.wr.last;
+      double cycles = last - first;
+      if (cycles > 0)
+        std::cout << "  estimated bus efficiency "
+                  << percent(t.rd.bytes + t.wr.bytes, (unsigned long long)(cycles * width))
+                  << "% (" << (unsigned long long)(cycles + 0.5) << " cycles for "
+                  << t.rd.bytes + t.wr.bytes << " bytes)" << std::endl;
+    }
+  }
+};
+
+/// Pointer to an m_axi buffer that records its accesses when
+/// HLS_MAXI_PROFILE is set, and otherwise only loads and stores:
+///
+///   void kernel(int *in_, int *out_, int size) {
+///     hls::maxi_ptr<int> in(in_, "gmem0", "in"), out(out_, "gmem0", "out");
+///     for (int i = 0; i < size; i++)
+///       out[i] = in[i] + 1;
+///   }
+///
+/// For each bundle, the report printed at exit gives the burst length
+/// histogram, the sequential and port switch ratios and the bus
+/// efficiency estimated from the inferred bursts. It is a C simulation
+/// model only: keep the plain pointers under __SYNTHESIS__.
+template<typename T>
+class maxi_ptr {
+public:
+  class ref {
+    const maxi_ptr &p;
+    size_t i;
+  public:
+    ref(const maxi_ptr &ptr, size_t index) : p(ptr), i(index) {}
+
+    operator T() const {
+      if (p.bundle)
+        p.bundle->access(p.port, false, p.base + i);
+      return p.ptr[i];
+    }
+
+    ref &operator=(const T &v) {
+      if (p.bundle)
+        p.bundle->access(p.port, true, p.base + i);
+      p.ptr[i] = v;
+      return *this;
+    }
+
+    ref &operator=(const ref &r) {
+      return *this = (T)r;
+    }
+
+    // Read-modify-write: a read then a write of the element
+    template<typename U> ref &operator+=(const U &v) { T t = *this; t += v; return *this = t; }
+    template<typename U> ref &operator-=(const U &v) { T t = *this; t -= v; return *this = t; }
+    template<typename U> ref &operator*=(const U &v) { T t = *this; t *= v; return *this = t; }
+    template<typename U> ref &operator/=(const U &v) { T t = *this; t /= v; return *this = t; }
+    template<typename U> ref &operator%=(const U &v) { T t = *this; t %= v; return *this = t; }
+    template<typename U> ref &operator&=(const U &v) { T t = *this; t &= v; return *this = t; }
+    template<typename U> ref &operator|=(const U &v) { T t = *this; t |= v; return *this = t; }
+    template<typename U> ref &operator^=(const U &v) { T t = *this; t ^= v; return *this = t; }
+    template<typename U> ref &operator<<=(const U &v) { T t = *this; t <<= v; return *this = t; }
+    template<typename U> ref &operator>>=(const U &v) { T t = *this; t >>= v; return *this = t; }
+
+    ref &operator++() { T t = *this; ++t; return *this = t; }
+    ref &operator--() { T t = *this; --t; return *this = t; }
+
+    T operator++(int) {
+      T old = *this;
+      T t = old;
+      *this = ++t;
+      return old;
+    }
+
+    T operator--(int) {
+      T old = *this;
+      T t = old;
+      *this = --t;
+      return old;
+    }
+  };
+
+  maxi_ptr(T *p, const char *bundle_name, const char *port_name = 0)
+    : ptr(p), base(0), bundle(0), port(-1) {
+    if (maxi_bundle_profile::enabled()) {
+      bundle = maxi_bundle_profile::get(bundle_name, sizeof(T));
+      port = bundle->add_port(port_name, sizeof(T));
+    }
+  }
+
+  ref operator[](size_t i) const { return ref(*this, i); }
+
+  ref operator*() const { return ref(*this, 0); }
+
+  /// Same port, 'n' elements further
+  maxi_ptr operator+(ptrdiff_t n) const {
+    maxi_ptr r(*this);
+    r.ptr += n;
+    r.base += n;
+    return r;
+  }
+
+  T *get() const { return ptr; }
+
+private:
+  T *ptr;
+  size_t base;
+  maxi_bundle_profile *bundle;
+  int port;
+};
+
+} // namespace hls
+
+#endif // __cplusplus
+#endif // X_HLS_MAXI_PROFILE_SIM_H
@@ -6,140 +6,716 @@
 #ifndef X_HLS_NP_CHANNEL_SIM_H
 #define X_HLS_NP_CHANNEL_SIM_H
 
+#ifdef __SYNTHESIS__
+#include "hls_stream.h"
+#include "hls_task.h"
+#include <type_traits>
+namespace hls {
+/// Tag FIFO of split::in_order and merge::in_order in hardware: the
+/// split queues the port of each element it deals out, and the merge
+/// reads the result of that port next. Each worker writes its results
+/// in the order it read the elements, so the worker output streams
+/// make up the reorder buffer. WINDOW tags hold the split back WINDOW
+/// elements ahead of the merge output, as in simulation.
+template <unsigned N_PORTS, unsigned WINDOW>
+struct in_order_tags {
+  typedef typename std::conditional<(N_PORTS <= 256), unsigned char,
+                                    unsigned short>::type port_t;
+  stream<port_t, WINDOW> fifo;
+};
+
+namespace split {
+template <typename T, unsigned N_OUT_PORTS, unsigned WINDOW = 2 * N_OUT_PORTS>
+class in_order {
+  typedef in_order_tags<N_OUT_PORTS, WINDOW> tags_t;
+  task dealer;
+public:
+  stream<T> in;
+  stream<T> out[N_OUT_PORTS];
+  tags_t tags;
+  in_order() {
+#pragma HLS inline
+    dealer(deal, in, out, tags.fifo);
+  }
+  in_order(const char *) {
+#pragma HLS inline
+    dealer(deal, in, out, tags.fifo);
+  }
+
+private:
+  /// Deal each element to the lowest numbered port with room, or wait
+  /// for port 0 when all of them are full
+  static void deal(stream<T> &in, stream<T> (&out)[N_OUT_PORTS],
+                   stream<typename tags_t::port_t, WINDOW> &tags) {
+#pragma HLS pipeline II=1 style=flp
+    T elem = in.read();
+    typename tags_t::port_t port = 0;
+    bool found = false;
+    for (unsigned i = 0; i < N_OUT_PORTS; i++) {
+#pragma HLS unroll
+      if (!found && !out[i].full()) {
+        port = i;
+        found = true;
+      }
+    }
+    out[port].write(elem);
+    tags.write(port);
+  }
+};
+} // end of namespace split
+
+namespace merge {
+template <typename T, unsigned N_IN_PORTS, unsigned WINDOW = 2 * N_IN_PORTS>
+class in_order {
+  typedef in_order_tags<N_IN_PORTS, WINDOW> tags_t;
+  task collector;
+public:
+  stream<T> in[N_IN_PORTS];
+  stream<T> out;
+  in_order(split::in_order<T, N_IN_PORTS, WINDOW> &split) {
+#pragma HLS inline
+    collector(collect, split.tags.fifo, in, out);
+  }
+  in_order(split::in_order<T, N_IN_PORTS, WINDOW> &split, const char *) {
+#pragma HLS inline
+    collector(collect, split.tags.fifo, in, out);
+  }
+
+private:
+  static void collect(stream<typename tags_t::port_t, WINDOW> &tags,
+                      stream<T> (&in)[N_IN_PORTS], stream<T> &out) {
+#pragma HLS pipeline II=1 style=flp
+    out.write(in[tags.read()].read());
+  }
+};
+} // end of namespace merge
+} // end of namespace hls
+
+#else
 #include "hls_stream.h"
 #include <string.h>
+#include <deque>
 namespace hls {
+/// Delegate of one port of an n-port channel NP: 'home' is the index of
+/// the port, or -1 for the single port at the other end
+template <typename T, class NP>
+class np_port : public stream_delegate<sizeof(T)> {
+  NP *np;
+  int home;
+public:
+  void init(NP *n, int h) { np = n; home = h; }
+  virtual size_t size() { return np->size(); }
+  virtual bool read(void *elem) { return np->read(home, elem); }
+  virtual bool read_nb(void *elem) { return np->read_nb(home, elem); }
+  virtual void write(const void *elem) { np->write(home, elem); }
+  virtual stream_base *channel() { return np; }
+};
+
+/// N-port channel of split::load_balance and merge::load_balance. The
+/// elements are sharded in one queue per port, each with its own lock:
+/// a writer of merge::load_balance only touches the queue of its port,
+/// and the writer of split::load_balance deals them out in turn. A
+/// reader takes from its own queue first, then steals from the others,
+/// so a busy port never holds back an idle worker. The channel lock
+/// (of stream_base) is only taken by readers finding every queue empty,
+/// and by a writer once per parked reader, to wake it up.
 template <typename T, unsigned N_OUT_PORTS, unsigned N_IN_PORTS>
-class load_balancing_np : public stream_delegate<sizeof(T)> {
+class load_balancing_np : public stream_base {
 private:
-  std::string name;
-  std::deque<std::array<char, sizeof(T)> > _data;
+  enum { N_SHARDS = N_OUT_PORTS > N_IN_PORTS ? N_OUT_PORTS : N_IN_PORTS };
+
+  /// Queue of one port, on its own cache line
+  struct alignas(64) shard {
 #ifndef HLS_STREAM_THREAD_UNSAFE
-  std::mutex _mutex;
-  std::condition_variable _condition_var;
-  bool invalid;
+    std::mutex mutex;
 #endif
+    std::atomic<size_t> size;
+    stream_queue<std::array<char, sizeof(T)> > data;
+    // Folded into the channel statistics by get_stats()
+    stream_stats stats;
+    int last_reader;
+    int last_writer;
+    std::vector<int> readers;
+    std::vector<int> writers;
+    shard() : size(0), stats(), last_reader(-1), last_writer(-1) {}
+  };
+
+  shard shards[N_SHARDS];
+  std::atomic<long> count;       // elements in all the shards
+  std::atomic<unsigned> next;    // shard of the next element dealt out
+  std::atomic<unsigned> sleepers;  // checks of 'count' by parking readers
+  std::atomic<int> writer;       // task that wrote last, for deadlock reports
+
 protected:
-#ifdef HLS_STREAM_THREAD_UNSAFE
-  load_balancing_np() {}
-  load_balancing_np(const char *n) : name(n) {}
-#else
-  load_balancing_np(): invalid(false) {}
-  load_balancing_np(const char *n) : name(n), invalid(false) {}
+  // The single reader of a merge scans the ports from the first one,
+  // instead of from the port after the last one it read
+  bool by_priority;
+
+  load_balancing_np() : count(0), next(0), sleepers(0), writer(-1), by_priority(false) {
+    init_spin();
+  }
+  load_balancing_np(const char *n)
+    : count(0), next(0), sleepers(0), writer(-1), by_priority(false) {
+    init_name(n);
+    init_spin();
+  }
   ~load_balancing_np() {
-    std::unique_lock<std::mutex> ul(_mutex);
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::unique_lock<std::mutex> ul(mutex);
+    invalid = true;
+    notify_all_readers();
+#endif
+    // unregister_stream() reads the statistics without the lock
+    fold_stats();
+  }
+
+public:
+  size_t size() {
+    long n = count.load();
+    return n > 0 ? n : 0;
+  }
+
+  /// Statistics of the channel, including those of the shards
+  virtual stream_stats get_stats() {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    fold_stats();
+    return stats;
+  }
+
+  bool read(int home, void *elem) {
+    // needed to start the size reporter
+    stream_globals::start_threads();
+    while (!read_nb(home, elem)) {
+#ifdef ALLOW_EMPTY_HLS_STREAM_READS
+      std::cout << "WARNING [HLS SIM]: n-port channel '"
+                << get_name()
+                << "' is read while empty,"
+                << " which may result in RTL simulation hanging."
+                << std::endl;
+      return false;
+#else
+      if (spin_on_count())
+        continue;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      std::unique_lock<std::mutex> ul(mutex);
+#endif
+      if (writer.load(std::memory_order_relaxed) != last_writer)
+        seen(last_writer, writers, writer.load(std::memory_order_relaxed));
+      update_blocked(size());
+      auto start = std::chrono::steady_clock::now();
+      // Every shard looked empty: wait until a writer adds an element. The
+      // reader counts itself in 'sleepers' before each check of 'count',
+      // and a writer claims a sleeper after updating 'count', so one of
+      // the two sees the other. A count left by a reader that did not park
+      // only costs one writer a needless wake-up.
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      wait_readable(ul, [this] { sleepers++; return count.load() > 0; });
+#else
+      wait_readable([this] { return count.load() > 0; });
+#endif
+      consumer_blocked(stream_stats::elapsed_ns(start));
+#endif
+    }
+    return true;
+  }
+
+  /// Pop an element from the 'home' shard, or else steal one
+  bool read_nb(int home, void *elem) {
+    bool merge = home < 0 && N_IN_PORTS > 1;
+    unsigned first = home >= 0 ? home : by_priority ? 0 : next.load(std::memory_order_relaxed);
+    for (unsigned i = 0; i < N_SHARDS; i++) {
+      unsigned k = (first + i) % N_SHARDS;
+      shard &s = shards[k];
+      if (!s.size.load(std::memory_order_relaxed))
+        continue;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      std::lock_guard<std::mutex> lg(s.mutex);
+#endif
+      if (s.data.empty())
+        continue;
+      memcpy(elem, s.data.front().data(), sizeof(T));
+      s.data.pop_front();
+      s.size.store(s.data.size(), std::memory_order_relaxed);
+      long n = --count;
+      s.stats.sample(n > 0 ? n : 0);
+      seen(s.last_reader, s.readers, stream_globals::current_task());
+      if (merge && !by_priority)
+        next.store((k + 1) % N_SHARDS, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+
+  void write(int home, const void *elem) {
+    stream_globals::start_threads();
+    unsigned i = home >= 0 ? home : next.fetch_add(1, std::memory_order_relaxed) % N_SHARDS;
+    shard &s = shards[i];
+    {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      std::unique_lock<std::mutex> ul(s.mutex, std::try_to_lock);
+      if (!ul.owns_lock()) {
+        auto start = std::chrono::steady_clock::now();
+        ul.lock();
+        s.stats.producer_blocked_ns += stream_stats::elapsed_ns(start);
+      }
+#endif
+      s.data.push_back(std::array<char, sizeof(T)>());
+      memcpy(s.data.back().data(), elem, sizeof(T));
+      s.size.store(s.data.size(), std::memory_order_relaxed);
+      long n = ++count;
+      s.stats.elements++;
+      s.stats.sample(n > 0 ? n : 0);
+      int task = stream_globals::current_task();
+      seen(s.last_writer, s.writers, task);
+      if (writer.load(std::memory_order_relaxed) != task)
+        writer.store(task, std::memory_order_relaxed);
+    }
+    if (claim_sleeper()) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      std::lock_guard<std::mutex> lg(mutex);
+#endif
+      wrote(size());
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      notify_reader();
+#endif
+    }
+  }
+
+private:
+  /// The spin of wait_readable() watches the occupancy, which the writers
+  /// only update when they wake up a reader: read() spins on 'count'
+  void init_spin() {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    set_spin_count(0);
+#endif
+  }
+
+  /// Spin phase of read(), on the element count, which the writers update
+  /// without the channel lock. Fibers switch at once, as in wait_readable().
+  bool spin_on_count() {
+#if defined(HLS_STREAM_THREAD_UNSAFE) || defined(HLS_TASK_COROUTINE_SIM)
+    return false;
+#else
+#ifdef HLS_TASK_POOL_SIM
+    if (task_pool::current())
+      return false;
+#endif
+    for (unsigned i = 0, n = stream_globals::get_spin_count();
+         i < n && count.load(std::memory_order_relaxed) <= 0; i++)
+      stream_globals::cpu_relax();
+    return count.load(std::memory_order_relaxed) > 0;
+#endif
+  }
+
+  /// Take one reader off 'sleepers', if any: the caller wakes one up
+  bool claim_sleeper() {
+    unsigned n = sleepers.load();
+    while (n && !sleepers.compare_exchange_weak(n, n - 1)) {
+    }
+    return n != 0;
+  }
+
+  /// Move the statistics of the shards to the channel, under its lock
+  void fold_stats() {
+    for (unsigned i = 0; i < N_SHARDS; i++) {
+      shard &s = shards[i];
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      std::lock_guard<std::mutex> lg(s.mutex);
+#endif
+      stats.merge(s.stats);
+      s.stats = stream_stats();
+      graph_edge::add(readers, s.readers);
+      graph_edge::add(writers, s.writers);
+    }
+  }
+};
+
+template <typename T, unsigned N_PORTS, unsigned WINDOW>
+class in_order_merge_np;
+
+/// N-port channel of split::in_order: the workers take the elements in
+/// turn like split::load_balance, and each element is numbered when it
+/// is dealt out. The number goes to the merge::in_order of the channel,
+/// queued per port, so the worker itself sees plain elements. While
+/// hls::tasks run, no element is dealt out more than WINDOW ahead of
+/// the merge output: the reorder buffer of the merge never overflows.
+template <typename T, unsigned N_PORTS, unsigned WINDOW>
+class in_order_split_np : public stream_base {
+private:
+  stream_queue<std::array<char, sizeof(T)> > _data;
+  unsigned long long next_seq;
+  in_order_merge_np<T, N_PORTS, WINDOW> *merge;
+  friend class in_order_merge_np<T, N_PORTS, WINDOW>;
+
+protected:
+  in_order_split_np() : next_seq(0), merge(0) {}
+  in_order_split_np(const char *n) : next_seq(0), merge(0) { init_name(n); }
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  ~in_order_split_np() {
+    std::unique_lock<std::mutex> ul(mutex);
     invalid = true;
-    _condition_var.notify_all();
+    notify_all_readers();
   }
 #endif
 
+  /// Elements that can be dealt out now. Without hls::tasks, the
+  /// dataflow processes run one after the other, so the window is open.
+  size_t dealable() {
+    size_t n = _data.size();
+    if (merge && stream_globals::tasks_running()) {
+      unsigned long long ahead = next_seq - merge->emitted.load();
+      size_t room = ahead < WINDOW ? WINDOW - ahead : 0;
+      if (room < n)
+        n = room;
+    }
+    return n;
+  }
+
 public:
-  virtual size_t size() {
+  size_t size() {
 #ifndef HLS_STREAM_THREAD_UNSAFE
-    std::lock_guard<std::mutex> lg(_mutex);
+    std::lock_guard<std::mutex> lg(mutex);
 #endif
     return _data.size();
   }
 
-  virtual bool read(void *elem) {
+  bool read(int home, void *elem) {
+    stream_globals::start_threads();
+    if (home < 0) {
+      std::cout << "WARNING [HLS SIM]: the 'in' port of n-port channel '"
+                << get_name()
+                << "' cannot be read."
+                << std::endl;
+      return false;
+    }
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::unique_lock<std::mutex> ul(mutex);
+#endif
+    if (!merge) {
+      std::cerr << "ERROR: split::in_order " << get_name() << " is read without a merge::in_order." << std::endl;
+      abort();
+    }
+    if (!dealable()) {
 #ifdef ALLOW_EMPTY_HLS_STREAM_READS
-    if (_data.empty()) {
       std::cout << "WARNING [HLS SIM]: n-port channel '"
-                << name
+                << get_name()
                 << "' is read while empty,"
                 << " which may result in RTL simulation hanging."
                 << std::endl;
       return false;
-    }
 #else
-    std::unique_lock<std::mutex> ul(_mutex);
-    stream_globals::incr_blocked_counter();
-    while (_data.empty()) {
+      auto start = std::chrono::steady_clock::now();
 #ifndef HLS_STREAM_THREAD_UNSAFE
-      while (invalid) {
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-      }
-      _condition_var.wait(ul);
+      wait_readable(ul, [this] { return dealable() != 0; });
+#else
+      wait_readable([this] { return dealable() != 0; });
+#endif
+      consumer_blocked(stream_stats::elapsed_ns(start));
 #endif
     }
-    stream_globals::decr_blocked_counter();
+    unsigned long long seq = deal(elem);
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    ul.unlock();
 #endif
-    
+    merge->tag(home, seq);
+    return true;
+  }
+
+  bool read_nb(int home, void *elem) {
+    if (home < 0)
+      return read(home, elem);
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::unique_lock<std::mutex> ul(mutex);
+#endif
+    if (!merge || !dealable())
+      return false;
+    unsigned long long seq = deal(elem);
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    ul.unlock();
+#endif
+    merge->tag(home, seq);
+    return true;
+  }
+
+  void write(int home, const void *elem) {
+    stream_globals::start_threads();
+    if (home >= 0) {
+      std::cout << "WARNING [HLS SIM]: the 'out' ports of n-port channel '"
+                << get_name()
+                << "' cannot be written."
+                << std::endl;
+      return;
+    }
+    std::array<char, sizeof(T)> elem_data;
+    memcpy(elem_data.data(), elem, sizeof(T));
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    _data.push_back(elem_data);
+    stats.elements++;
+    stats.sample(_data.size());
+    wrote(dealable());
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    notify_reader();
+#endif
+  }
+
+private:
+  /// Pop the head element and number it, under the channel lock
+  unsigned long long deal(void *elem) {
     memcpy(elem, _data.front().data(), sizeof(T));
     _data.pop_front();
+    stats.sample(_data.size());
+    unsigned long long seq = next_seq++;
+    consumed(dealable());
+    return seq;
+  }
+
+  /// The merge output moved on: the window has room for one more
+  void advance() {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    update_blocked(dealable());
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    notify_reader();
+#endif
+  }
+};
+
+/// N-port channel of merge::in_order: a reorder buffer, which puts the
+/// element written to port i back at the position it was dealt out at
+/// by the split, and only lets the reader see the element that is next
+/// in input order. Each worker must write one element per element it
+/// read, in the same order.
+template <typename T, unsigned N_PORTS, unsigned WINDOW>
+class in_order_merge_np : public stream_base {
+private:
+  struct slot {
+    bool valid;
+    std::array<char, sizeof(T)> data;
+  };
+  // Slot 0 holds element 'emitted', the next one in input order
+  std::deque<slot> rob;
+  size_t buffered;
+  std::atomic<unsigned long long> emitted;
+  // Numbers of the elements dealt out to each worker, oldest first
+  stream_queue<unsigned long long> tags[N_PORTS];
+  in_order_split_np<T, N_PORTS, WINDOW> *split;
+  friend class in_order_split_np<T, N_PORTS, WINDOW>;
+
+protected:
+  in_order_merge_np(in_order_split_np<T, N_PORTS, WINDOW> &s)
+    : buffered(0), emitted(0), split(&s) {
+    link(this);
+  }
+  in_order_merge_np(in_order_split_np<T, N_PORTS, WINDOW> &s, const char *n)
+    : buffered(0), emitted(0), split(&s) {
+    init_name(n);
+    link(this);
+  }
+  ~in_order_merge_np() {
+    link(0);
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::unique_lock<std::mutex> ul(mutex);
+    invalid = true;
+    notify_all_readers();
+#endif
+  }
+
+  /// Elements readable in order
+  size_t readable() {
+    size_t n = 0;
+    while (n < rob.size() && rob[n].valid)
+      n++;
+    return n;
+  }
+
+public:
+  size_t size() {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    return readable();
+  }
+
+  bool read(int home, void *elem) {
+    stream_globals::start_threads();
+    if (home >= 0) {
+      std::cout << "WARNING [HLS SIM]: the 'in' ports of n-port channel '"
+                << get_name()
+                << "' cannot be read."
+                << std::endl;
+      return false;
+    }
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::unique_lock<std::mutex> ul(mutex);
+#endif
+    if (!head_valid()) {
+#ifdef ALLOW_EMPTY_HLS_STREAM_READS
+      std::cout << "WARNING [HLS SIM]: n-port channel '"
+                << get_name()
+                << "' is read while empty,"
+                << " which may result in RTL simulation hanging."
+                << std::endl;
+      return false;
+#else
+      auto start = std::chrono::steady_clock::now();
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      wait_readable(ul, [this] { return head_valid(); });
+#else
+      wait_readable([this] { return head_valid(); });
+#endif
+      consumer_blocked(stream_stats::elapsed_ns(start));
+#endif
+    }
+    emit(elem);
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    ul.unlock();
+#endif
+    split->advance();
     return true;
   }
 
-  virtual bool read_nb(void *elem) {
+  bool read_nb(int home, void *elem) {
+    if (home >= 0)
+      return read(home, elem);
 #ifndef HLS_STREAM_THREAD_UNSAFE
-    std::lock_guard<std::mutex> lg(_mutex);
+    std::unique_lock<std::mutex> ul(mutex);
+#endif
+    if (!head_valid())
+      return false;
+    emit(elem);
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    ul.unlock();
 #endif
-    bool is_empty = _data.empty();
-    if (!is_empty) {
-      memcpy(elem, _data.front().data(), sizeof(T));
-      _data.pop_front();
+    split->advance();
+    return true;
+  }
+
+  void write(int home, const void *elem) {
+    stream_globals::start_threads();
+    if (home < 0) {
+      std::cout << "WARNING [HLS SIM]: the 'out' port of n-port channel '"
+                << get_name()
+                << "' cannot be written."
+                << std::endl;
+      return;
     }
-    return !is_empty;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    if (tags[home].empty()) {
+      std::cerr << "ERROR: port " << home << " of merge::in_order " << get_name() << " is written more times than the split::in_order port was read." << std::endl;
+      abort();
+    }
+    size_t pos = tags[home].front() - emitted.load();
+    tags[home].pop_front();
+    if (pos >= rob.size())
+      rob.resize(pos + 1);
+    rob[pos].valid = true;
+    memcpy(rob[pos].data.data(), elem, sizeof(T));
+    buffered++;
+    stats.elements++;
+    stats.sample(buffered);
+    wrote(head_valid() ? 1 : 0);
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    if (!pos)
+      notify_reader();
+#endif
   }
 
-  virtual void write(const void *elem) {
+private:
+  bool head_valid() {
+    return !rob.empty() && rob.front().valid;
+  }
+
+  /// Pop the head element, under the channel lock
+  void emit(void *elem) {
+    memcpy(elem, rob.front().data.data(), sizeof(T));
+    rob.pop_front();
+    buffered--;
+    emitted++;
+    stats.sample(buffered);
+    consumed(head_valid() ? 1 : 0);
+  }
+
+  /// Element 'seq' was dealt out to port 'home'
+  void tag(int home, unsigned long long seq) {
 #ifndef HLS_STREAM_THREAD_UNSAFE
-    std::unique_lock<std::mutex> ul(_mutex);
+    std::lock_guard<std::mutex> lg(mutex);
 #endif
-    std::array<char, sizeof(T)> elem_data;
-    memcpy(elem_data.data(), elem, sizeof(T));
-    _data.push_back(elem_data);
-    if (stream_globals::get_max_size() < _data.size())
-        stream_globals::get_max_size() = _data.size();
+    tags[home].push_back(seq);
+  }
+
+  void link(in_order_merge_np *m) {
 #ifndef HLS_STREAM_THREAD_UNSAFE
-    _condition_var.notify_one();
+    std::lock_guard<std::mutex> lg(split->mutex);
 #endif
+    split->merge = m;
   }
 };
 
 namespace split {
 template <typename T, unsigned N_OUT_PORTS, unsigned DEPTH = 2>
 class load_balance : public load_balancing_np<T, N_OUT_PORTS, 1> { 
+  typedef load_balancing_np<T, N_OUT_PORTS, 1> np_t;
+  np_port<T, np_t> ports[N_OUT_PORTS + 1];
 public:
   stream<T> in;
   stream<T> out[N_OUT_PORTS];
   load_balance() {
-    in.set_delegate(this);
-    for (int i = 0; i < N_OUT_PORTS; i++)
-      out[i].set_delegate(this);
+    set_ports();
   }
 
-  load_balance(const char *name) : load_balancing_np<T, N_OUT_PORTS, 1>(name) {
-    in.set_delegate(this);
-    for (int i = 0; i < N_OUT_PORTS; i++)
-      out[i].set_delegate(this);
+  load_balance(const char *name) : np_t(name) {
+    set_ports();
   }
-};
 
-template <typename T, unsigned N_OUT_PORTS, unsigned ONEPORT_DEPTH = 2, unsigned NPORT_DEPTH = 0>
-class round_robin : public stream_delegate<sizeof(T)> {
 private:
+  void set_ports() {
+    ports[N_OUT_PORTS].init(this, -1);
+    in.set_delegate(&ports[N_OUT_PORTS]);
+    for (unsigned i = 0; i < N_OUT_PORTS; i++) {
+      ports[i].init(this, i);
+      out[i].set_delegate(&ports[i]);
+    }
+  }
+};
+
+/// Delegate of the 'in' port of the splits that deal the elements out
+/// to ports chosen by next_port(), which runs under the lock of the
+/// split. The 'in' port cannot be read.
+template <typename T, unsigned N_OUT_PORTS>
+class dealing_split : public stream_delegate<sizeof(T)> {
+protected:
 #ifndef HLS_STREAM_THREAD_UNSAFE
   std::mutex _mutex;
 #endif
   std::string name;
-  int pos;
-public:
-  stream<T> in;
-  stream<T> out[N_OUT_PORTS];
-  round_robin() : pos(0) {
+
+  dealing_split() {
     in.set_delegate(this);
   }
 
-  round_robin(const char *n) : name(n), pos(0) {
+  dealing_split(const char *n) : name(n) {
     in.set_delegate(this);
   }
 
+  /// Port of the element being written
+  virtual unsigned next_port() = 0;
+
+public:
+  stream<T> in;
+  stream<T> out[N_OUT_PORTS];
+
   virtual size_t size() {
     return 0;
   }
 
-  virtual bool read(void *elem) {
+  virtual bool read(void *) {
     std::cout << "WARNING [HLS SIM]: the 'in' port of n-port channel '"
               << name
               << "' cannot be read."
@@ -155,8 +731,142 @@ public:
 #ifndef HLS_STREAM_THREAD_UNSAFE
     std::lock_guard<std::mutex> lg(_mutex);
 #endif
-    out[pos].write(*(T *)elem);
+    out[next_port()].write(*(T *)elem);
+  }
+};
+
+template <typename T, unsigned N_OUT_PORTS, unsigned ONEPORT_DEPTH = 2, unsigned NPORT_DEPTH = 0>
+class round_robin : public dealing_split<T, N_OUT_PORTS> {
+  typedef dealing_split<T, N_OUT_PORTS> base_t;
+  unsigned pos;
+public:
+  round_robin() : pos(0) {}
+
+  round_robin(const char *n) : base_t(n), pos(0) {}
+
+protected:
+  virtual unsigned next_port() {
+    unsigned p = pos;
     pos = (pos + 1) % N_OUT_PORTS;
+    return p;
+  }
+};
+
+/// Round robin where port i takes weights[i] elements in a row, for
+/// workers of unequal throughput. A port of weight 0 takes none.
+template <typename T, unsigned N_OUT_PORTS, unsigned ONEPORT_DEPTH = 2, unsigned NPORT_DEPTH = 0>
+class weighted : public dealing_split<T, N_OUT_PORTS> {
+  typedef dealing_split<T, N_OUT_PORTS> base_t;
+  unsigned weights[N_OUT_PORTS];
+  unsigned pos;
+  unsigned sent;
+public:
+  weighted() : pos(0), sent(0) {
+    for (unsigned i = 0; i < N_OUT_PORTS; i++)
+      weights[i] = 1;
+  }
+
+  weighted(const char *n) : base_t(n), pos(0), sent(0) {
+    for (unsigned i = 0; i < N_OUT_PORTS; i++)
+      weights[i] = 1;
+  }
+
+  void set_weights(const unsigned (&w)[N_OUT_PORTS]) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(this->_mutex);
+#endif
+    unsigned total = 0;
+    for (unsigned i = 0; i < N_OUT_PORTS; i++)
+      total += weights[i] = w[i];
+    if (!total) {
+      std::cout << "WARNING [HLS SIM]: n-port channel '"
+                << this->name
+                << "' has no port of non-zero weight, using weight 1 for all."
+                << std::endl;
+      for (unsigned i = 0; i < N_OUT_PORTS; i++)
+        weights[i] = 1;
+    }
+    sent = 0;
+    if (!weights[pos])
+      advance();
+  }
+
+protected:
+  virtual unsigned next_port() {
+    unsigned p = pos;
+    if (++sent >= weights[pos]) {
+      sent = 0;
+      advance();
+    }
+    return p;
+  }
+
+private:
+  void advance() {
+    do
+      pos = (pos + 1) % N_OUT_PORTS;
+    while (!weights[pos]);
+  }
+};
+
+/// Sends each element to the port holding the fewest elements, so that
+/// a slow worker does not hold back the others. Ties go to the port
+/// after the last one written.
+template <typename T, unsigned N_OUT_PORTS, unsigned ONEPORT_DEPTH = 2, unsigned NPORT_DEPTH = 0>
+class least_occupied : public dealing_split<T, N_OUT_PORTS> {
+  typedef dealing_split<T, N_OUT_PORTS> base_t;
+  unsigned pos;
+public:
+  least_occupied() : pos(0) {}
+
+  least_occupied(const char *n) : base_t(n), pos(0) {}
+
+protected:
+  virtual unsigned next_port() {
+    unsigned best = pos;
+    size_t best_size = this->out[pos].size();
+    for (unsigned i = 1; i < N_OUT_PORTS && best_size; i++) {
+      unsigned p = (pos + i) % N_OUT_PORTS;
+      size_t size = this->out[p].size();
+      if (size < best_size) {
+        best = p;
+        best_size = size;
+      }
+    }
+    pos = (best + 1) % N_OUT_PORTS;
+    return best;
+  }
+};
+
+/// Order-preserving split, to be paired with a merge::in_order: the
+/// merge outputs the results of the workers in the order the elements
+/// were written to 'in', whichever worker took them.
+///
+///   hls::split::in_order<T, N> sp;
+///   hls::merge::in_order<T, N> mg(sp);
+template <typename T, unsigned N_OUT_PORTS, unsigned WINDOW = 2 * N_OUT_PORTS>
+class in_order : public in_order_split_np<T, N_OUT_PORTS, WINDOW> {
+  typedef in_order_split_np<T, N_OUT_PORTS, WINDOW> np_t;
+  np_port<T, np_t> ports[N_OUT_PORTS + 1];
+public:
+  stream<T> in;
+  stream<T> out[N_OUT_PORTS];
+  in_order() {
+    set_ports();
+  }
+
+  in_order(const char *name) : np_t(name) {
+    set_ports();
+  }
+
+private:
+  void set_ports() {
+    ports[N_OUT_PORTS].init(this, -1);
+    in.set_delegate(&ports[N_OUT_PORTS]);
+    for (unsigned i = 0; i < N_OUT_PORTS; i++) {
+      ports[i].init(this, i);
+      out[i].set_delegate(&ports[i]);
+    }
   }
 };
 } // end of namespace split
@@ -165,19 +875,27 @@ namespace merge {
 
 template <typename T, unsigned N_IN_PORTS, unsigned DEPTH = 2>
 class load_balance : public load_balancing_np<T, 1, N_IN_PORTS> { 
+  typedef load_balancing_np<T, 1, N_IN_PORTS> np_t;
+  np_port<T, np_t> ports[N_IN_PORTS + 1];
 public:
   stream<T> in[N_IN_PORTS];
   stream<T> out;
   load_balance() {
-    out.set_delegate(this);
-    for (int i = 0; i < N_IN_PORTS; i++)
-      in[i].set_delegate(this);
+    set_ports();
   }
 
-  load_balance(const char *name) : load_balancing_np<T, 1, N_IN_PORTS>(name) {
-    out.set_delegate(this);
-    for (int i = 0; i < N_IN_PORTS; i++)
-      in[i].set_delegate(this);
+  load_balance(const char *name) : np_t(name) {
+    set_ports();
+  }
+
+private:
+  void set_ports() {
+    ports[N_IN_PORTS].init(this, -1);
+    out.set_delegate(&ports[N_IN_PORTS]);
+    for (unsigned i = 0; i < N_IN_PORTS; i++) {
+      ports[i].init(this, i);
+      in[i].set_delegate(&ports[i]);
+    }
   }
 };
 
@@ -227,13 +945,70 @@ public:
     return false; 
   }  
 
-  virtual void write(const void *elem) {
+  virtual void write(const void *) {
     std::cout << "WARNING [HLS SIM]: the 'out' port of n-port channel '"
               << name
               << "' cannot be written."
               << std::endl;
   }
 };
+
+/// Reorder buffer of WINDOW elements, restoring the input order of the
+/// split::in_order 'split' (see split::in_order)
+template <typename T, unsigned N_IN_PORTS, unsigned WINDOW = 2 * N_IN_PORTS>
+class in_order : public in_order_merge_np<T, N_IN_PORTS, WINDOW> {
+  typedef in_order_merge_np<T, N_IN_PORTS, WINDOW> np_t;
+  np_port<T, np_t> ports[N_IN_PORTS + 1];
+public:
+  stream<T> in[N_IN_PORTS];
+  stream<T> out;
+  in_order(split::in_order<T, N_IN_PORTS, WINDOW> &split) : np_t(split) {
+    set_ports();
+  }
+
+  in_order(split::in_order<T, N_IN_PORTS, WINDOW> &split, const char *name) : np_t(split, name) {
+    set_ports();
+  }
+
+private:
+  void set_ports() {
+    ports[N_IN_PORTS].init(this, -1);
+    out.set_delegate(&ports[N_IN_PORTS]);
+    for (unsigned i = 0; i < N_IN_PORTS; i++) {
+      ports[i].init(this, i);
+      in[i].set_delegate(&ports[i]);
+    }
+  }
+};
+/// Merge that always reads the lowest numbered port holding an element:
+/// port 0 has the highest priority, and can starve the others
+template <typename T, unsigned N_IN_PORTS, unsigned DEPTH = 2>
+class priority : public load_balancing_np<T, 1, N_IN_PORTS> {
+  typedef load_balancing_np<T, 1, N_IN_PORTS> np_t;
+  np_port<T, np_t> ports[N_IN_PORTS + 1];
+public:
+  stream<T> in[N_IN_PORTS];
+  stream<T> out;
+  priority() {
+    set_ports();
+  }
+
+  priority(const char *name) : np_t(name) {
+    set_ports();
+  }
+
+private:
+  void set_ports() {
+    this->by_priority = true;
+    ports[N_IN_PORTS].init(this, -1);
+    out.set_delegate(&ports[N_IN_PORTS]);
+    for (unsigned i = 0; i < N_IN_PORTS; i++) {
+      ports[i].init(this, i);
+      in[i].set_delegate(&ports[i]);
+    }
+  }
+};
 } // end of namespace merge
 } // end of namespace hls
+#endif // __SYNTHESIS__
 #endif
@@ -25,8 +25,15 @@
 #include <string>
 #include <sstream>
 #include <unordered_map>
+#include <map>
+#include <fstream>
 #include <cstring>
+#include <cstdlib>
+#include <cctype>
 #include <array>
+#include <algorithm>
+#include <vector>
+#include <tuple>
 #include <limits>
 #include <thread>
 #include <chrono>
@@ -39,6 +46,52 @@
 #include <stdlib.h>
 #endif
 
+#ifndef _MSC_VER
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef HLS_TASK_COROUTINE_SIM
+#ifdef _MSC_VER
+#error "HLS_TASK_COROUTINE_SIM requires ucontext support"
+#endif
+#include <ucontext.h>
+#include <functional>
+#endif
+
+#ifdef HLS_TASK_POOL_SIM
+#ifdef _MSC_VER
+#error "HLS_TASK_POOL_SIM requires ucontext support"
+#endif
+#ifdef HLS_TASK_COROUTINE_SIM
+#error "HLS_TASK_POOL_SIM and HLS_TASK_COROUTINE_SIM cannot be combined"
+#endif
+#include <ucontext.h>
+#include <functional>
+#endif
+
+#if defined(HLS_TASK_COROUTINE_SIM) || defined(HLS_TASK_POOL_SIM)
+#if defined(__SANITIZE_ADDRESS__)
+#define HLS_TASK_SWITCH_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define HLS_TASK_SWITCH_ASAN
+#endif
+#endif
+#ifdef HLS_TASK_SWITCH_ASAN
+#include <sanitizer/common_interface_defs.h>
+#endif
+#endif
+
 namespace hls {
 #if !defined(__HLS_COSIM__) && defined(__VITIS_HLS__)
 // We are in bcsim mode, where reads must be non-blocking
@@ -48,6 +101,8 @@ namespace hls {
 #endif
 #endif
 
+class stream_base;
+
 template<size_t SIZE>
 class stream_delegate {
 public:
@@ -55,122 +110,2599 @@ public:
   virtual void write(const void *elem) = 0;
   virtual bool read_nb(void *elem) = 0;
   virtual size_t size() = 0;
+  /// Channel keeping the data of the port, if not the delegate itself
+  virtual stream_base *channel() { return 0; }
+};
+struct task_group_state;
+struct task_profile;
+
+/// Per-task state of the simulation engines
+struct task_context {
+  int id = 0;                          // hls::task id, 0 for the testbench
+  task_group_state *group = 0;         // task_group of the task, if any
+  task_profile *profile = 0;           // with HLS_TASK_PROFILE
 };
 
-class stream_globals {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+/// CPUs and NUMA nodes of the host, and the core placement policy of the
+/// hls::task threads given by the HLS_TASK_AFFINITY environment variable:
+/// 'compact' fills the cores of a node before the next one, 'scatter'
+/// alternates between the nodes, and a list such as '0-3,8' names the
+/// cores. The k-th task (or pool worker) runs on the k-th core of the
+/// policy, modulo their number. Without the variable threads are not pinned.
+class sim_topology {
 public:
-  static void print_max_size() {
-#ifndef DISABLE_MAX_HLS_STREAM_DEPTH_PRINT
-    std::cout << "INFO [HLS SIM]: The maximum depth reached by any hls::stream() instance in the design is " << get_max_size() << std::endl;
+  static int node_count() {
+    return (int)get().nodes.size();
+  }
+
+  /// NUMA node of the CPU running the calling thread, -1 if unknown
+  static int current_node() {
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    const std::vector<int> &node_of = get().node_of;
+    if (cpu >= 0 && cpu < (int)node_of.size())
+      return node_of[cpu];
+#endif
+    return -1;
+  }
+
+  /// Core of the k-th thread under the policy, -1 without a policy
+  static int policy_cpu(unsigned k) {
+    const std::vector<int> &order = get().order;
+    return order.empty() ? -1 : order[k % order.size()];
+  }
+
+  /// Restrict thread h to the cores in cpus
+  static void pin(std::thread::native_handle_type h, const std::vector<int> &cpus) {
+#ifdef __linux__
+    if (cpus.empty())
+      return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus)
+      if (c >= 0 && c < CPU_SETSIZE)
+        CPU_SET(c, &set);
+    if (pthread_setaffinity_np(h, sizeof(set), &set))
+      std::cout << "WARNING [HLS SIM]: cannot set the affinity of an hls::task thread." << std::endl;
+#else
+    (void)h;
+    (void)cpus;
+#endif
+  }
+
+  /// Prefer node for the pages of [addr, addr + len), before first touch
+  static void bind(void *addr, size_t len, int node) {
+#ifdef __linux__
+    unsigned long mask[16] = { 0 };
+    if (node < 0 || node >= (int)(sizeof(mask) * 8))
+      return;
+    mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+    const int MPOL_PREFERRED_ = 1;
+    syscall(SYS_mbind, addr, len, MPOL_PREFERRED_, mask, sizeof(mask) * 8, 0);
+#else
+    (void)addr;
+    (void)len;
+    (void)node;
+#endif
+  }
+
+  /// Parse a core list such as "0-3,8"
+  static std::vector<int> parse_cpus(const char *list) {
+    std::vector<int> cpus;
+    const char *p = list;
+    while (p && *p) {
+      char *end;
+      long lo = strtol(p, &end, 10);
+      if (end == p)
+        break;
+      long hi = lo;
+      if (*end == '-')
+        hi = strtol(end + 1, &end, 10);
+      for (long c = lo; c <= hi; c++)
+        cpus.push_back((int)c);
+      if (*end != ',')
+        break;
+      p = end + 1;
+    }
+    return cpus;
+  }
+
+private:
+  struct info {
+    std::vector<std::vector<int> > nodes;  // allowed CPUs of each node
+    std::vector<int> node_of;              // node of each CPU
+    std::vector<int> order;                // placement policy
+  };
+
+  static info &get() {
+    static info *i = init();
+    return *i;
+  }
+
+  static info *init() {
+    info *i = new info();
+    std::vector<bool> allowed;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (!sched_getaffinity(0, sizeof(set), &set))
+      for (int c = 0; c < CPU_SETSIZE; c++)
+        if (CPU_ISSET(c, &set)) {
+          allowed.resize(c + 1);
+          allowed[c] = true;
+        }
+    for (int n = 0; ; n++) {
+      std::ifstream in("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+      if (!in)
+        break;
+      std::string list;
+      std::getline(in, list);
+      std::vector<int> cpus;
+      for (int c : parse_cpus(list.c_str())) {
+        if (c >= (int)i->node_of.size())
+          i->node_of.resize(c + 1, -1);
+        i->node_of[c] = n;
+        if (c < (int)allowed.size() && allowed[c])
+          cpus.push_back(c);
+      }
+      i->nodes.push_back(cpus);
+    }
+#endif
+    if (i->nodes.empty()) {
+      // No NUMA information: a single node
+      std::vector<int> cpus;
+      for (size_t c = 0; c < allowed.size(); c++)
+        if (allowed[c])
+          cpus.push_back((int)c);
+      i->nodes.push_back(cpus);
+    }
+
+    const char *policy = getenv("HLS_TASK_AFFINITY");
+    if (!policy || !*policy)
+      return i;
+    if (!strcmp(policy, "compact")) {
+      for (size_t n = 0; n < i->nodes.size(); n++)
+        i->order.insert(i->order.end(), i->nodes[n].begin(), i->nodes[n].end());
+    } else if (!strcmp(policy, "scatter")) {
+      for (size_t k = 0; ; k++) {
+        bool more = false;
+        for (size_t n = 0; n < i->nodes.size(); n++)
+          if (k < i->nodes[n].size()) {
+            i->order.push_back(i->nodes[n][k]);
+            more = true;
+          }
+        if (!more)
+          break;
+      }
+    } else {
+      i->order = parse_cpus(policy);
+      if (i->order.empty())
+        std::cout << "WARNING [HLS SIM]: ignoring HLS_TASK_AFFINITY='" << policy
+                  << "', expected compact, scatter or a list of cores." << std::endl;
+    }
+    return i;
+  }
+};
+#endif
+
+#if defined(HLS_TASK_COROUTINE_SIM) || defined(HLS_TASK_POOL_SIM)
+#ifndef HLS_TASK_STACK_SIZE
+#define HLS_TASK_STACK_SIZE (8 * 1024 * 1024)
+#endif
+
+/// Stack of a coroutine or fiber, or of the thread that switches to it.
+/// AddressSanitizer must be told of every switch: a task that throws,
+/// e.g. when its task_group stops it, unwinds its own stack. The stack
+/// of a thread is learned when it first switches to a task.
+struct sim_stack {
+  const void *bottom = 0;
+  size_t size = 0;
+  void *fake = 0;            // fake stack of the suspended context
+
+  /// Switching from this context to 'to'. An exiting context never
+  /// runs again.
+  void leave(const sim_stack &to, bool exiting = false) {
+#ifdef HLS_TASK_SWITCH_ASAN
+    __sanitizer_start_switch_fiber(exiting ? 0 : &fake, to.bottom, to.size);
+#else
+    (void)to;
+    (void)exiting;
+#endif
+  }
+
+  /// This context runs again, switched to from 'from'
+  void enter(sim_stack &from) {
+#ifdef HLS_TASK_SWITCH_ASAN
+    __sanitizer_finish_switch_fiber(fake, &from.bottom, &from.size);
+#else
+    (void)from;
+#endif
+  }
+};
+#endif
+
+#ifdef HLS_TASK_COROUTINE_SIM
+
+/// Deterministic simulation engine selected by HLS_TASK_COROUTINE_SIM.
+/// Every hls::task runs as a stackful coroutine on the testbench thread,
+/// and a coroutine only gives up the thread when a channel read would
+/// block. The ready queue is FIFO, so a given testbench always runs the
+/// same interleaving, and no OS thread is created per task. The channels
+/// must only be accessed by the tasks and the testbench thread: a read
+/// that nothing ready can satisfy is reported as a deadlock at once.
+class coroutine_scheduler {
+public:
+  struct coroutine {
+    ucontext_t context;
+    char *stack;
+    sim_stack bounds;
+    task_context task;       // empty for the testbench
+    coroutine *next;         // link in the ready queue or in a wait list
+    std::function<void()> body;
+  };
+
+  /// Coroutine being executed, the testbench when no hls::task runs
+  static coroutine *&current() {
+    static coroutine *c = &get_testbench();
+    return c;
+  }
+
+  static void spawn(const std::function<void()> &body) {
+    coroutine *c = new coroutine();
+    c->stack = new char[HLS_TASK_STACK_SIZE];
+    c->bounds.bottom = c->stack;
+    c->bounds.size = HLS_TASK_STACK_SIZE;
+    c->next = 0;
+    c->body = body;
+    getcontext(&c->context);
+    c->context.uc_stack.ss_sp = c->stack;
+    c->context.uc_stack.ss_size = HLS_TASK_STACK_SIZE;
+    c->context.uc_link = 0;
+    makecontext(&c->context, entry, 0);
+    make_ready(c);
+  }
+
+  /// Append c to the ready queue
+  static void make_ready(coroutine *c) {
+    coroutine *&tail = get_ready_tail();
+    c->next = 0;
+    if (tail)
+      tail->next = c;
+    else
+      get_ready_head() = c;
+    tail = c;
+  }
+
+  /// Suspend the current coroutine until it is made ready again and run
+  /// the next ready one. Nothing ready means nothing can ever write.
+  static void suspend();
+
+  /// Let the ready coroutines run before the current one continues
+  static void yield() {
+    if (!get_ready_head())
+      return;
+    make_ready(current());
+    switch_to(pop_ready());
+  }
+
+private:
+  static coroutine &get_testbench() {
+    static coroutine *c = new coroutine();
+    return *c;
+  }
+
+  static coroutine *&get_ready_head() {
+    static coroutine *head = 0;
+    return head;
+  }
+
+  static coroutine *&get_ready_tail() {
+    static coroutine *tail = 0;
+    return tail;
+  }
+
+  static coroutine *pop_ready() {
+    coroutine *c = get_ready_head();
+    if (c) {
+      get_ready_head() = c->next;
+      if (!c->next)
+        get_ready_tail() = 0;
+      c->next = 0;
+    }
+    return c;
+  }
+
+  static void switch_to(coroutine *c) {
+    coroutine *prev = current();
+    if (task_profile *p = prev->task.profile)
+      account(p);
+    else
+      get_switch_time() = std::chrono::steady_clock::now();
+    current() = c;
+    get_switched_from() = prev;
+    prev->bounds.leave(c->bounds, get_finished() == prev);
+    swapcontext(&prev->context, &c->context);
+    prev->bounds.enter(get_switched_from()->bounds);
+    reap();
+  }
+
+  /// Coroutine that made the last switch
+  static coroutine *&get_switched_from() {
+    static coroutine *c = 0;
+    return c;
+  }
+
+  /// Start of the time slice of the running coroutine
+  static std::chrono::steady_clock::time_point &get_switch_time() {
+    static std::chrono::steady_clock::time_point t;
+    return t;
+  }
+
+  static void account(task_profile *p);
+
+  /// Coroutine that returned, freed by the next one to run on its stack
+  static coroutine *&get_finished() {
+    static coroutine *finished = 0;
+    return finished;
+  }
+
+  static void reap() {
+    if (coroutine *c = get_finished()) {
+      get_finished() = 0;
+      delete[] c->stack;
+      delete c;
+    }
+  }
+
+  static void entry() {
+    current()->bounds.enter(get_switched_from()->bounds);
+    reap();
+    // Task bodies loop forever, unless their task_group stops them
+    current()->body();
+    get_finished() = current();
+    suspend();
+  }
+};
+typedef coroutine_scheduler::coroutine sim_fiber;
+#endif
+
+#ifdef HLS_TASK_POOL_SIM
+/// Parallel simulation engine selected by HLS_TASK_POOL_SIM. Every
+/// hls::task runs as a stackful fiber on a fixed pool of worker threads,
+/// HLS_TASK_POOL_SIZE from the environment or the number of cores. A fiber
+/// that would block on a channel gives its worker to the next ready one,
+/// and idle workers steal ready fibers from the busy ones. Fibers migrate
+/// between workers, so hls_thread_local variables of task bodies are per
+/// worker thread rather than per task in this mode.
+class task_pool {
+public:
+  struct fiber {
+    ucontext_t context;
+    char *stack;
+    sim_stack bounds;
+    task_context task;
+    fiber *next;             // link in a ready queue or in a wait list
+    std::function<void()> body;
+  };
+
+  /// Fiber run by the calling thread, null on the testbench threads.
+  /// Thread locals are only read through non-inlined functions: a fiber
+  /// may resume on another worker, and the compiler must not reuse the
+  /// thread-local addresses of the previous one.
+  __attribute__((noinline)) static fiber *current() {
+    worker *w = get_worker();
+    return w ? w->running : 0;
+  }
+
+  static void spawn(const std::function<void()> &body) {
+    static bool started = start_workers();
+    (void)started;
+    fiber *f = new fiber();
+    f->stack = new char[HLS_TASK_STACK_SIZE];
+    f->bounds.bottom = f->stack;
+    f->bounds.size = HLS_TASK_STACK_SIZE;
+    f->next = 0;
+    f->body = body;
+    getcontext(&f->context);
+    f->context.uc_stack.ss_sp = f->stack;
+    f->context.uc_stack.ss_size = HLS_TASK_STACK_SIZE;
+    f->context.uc_link = 0;
+    makecontext(&f->context, entry, 0);
+    make_ready(f);
+  }
+
+  /// Queue f on the calling worker, which is likely to have the data f
+  /// waited for in its cache, or on the next worker from a testbench thread
+  static void make_ready(fiber *f) {
+    worker *w = get_worker();
+    if (!w) {
+      std::vector<worker *> &all = get_workers();
+      w = all[get_next_worker().fetch_add(1, std::memory_order_relaxed) % all.size()];
+    }
+    {
+      std::lock_guard<std::mutex> lg(w->mutex);
+      f->next = 0;
+      if (w->tail)
+        w->tail->next = f;
+      else
+        w->head = f;
+      w->tail = f;
+    }
+    get_ready_count()++;
+    if (get_idle_count()) {
+      std::lock_guard<std::mutex> lg(get_idle_mutex());
+      get_idle_cv().notify_one();
+    }
+  }
+
+  /// Give the worker to the next ready fiber until make_ready(current()).
+  /// 'ul' is released by the worker once the fiber context is saved, so
+  /// the writer that wakes the fiber up cannot resume it too early.
+  __attribute__((noinline)) static void park(std::unique_lock<std::mutex> *ul) {
+    worker *w = get_worker();
+    w->unlock = ul;
+    switch_out(w);
+  }
+
+  /// Let the ready fibers run before the current one continues
+  __attribute__((noinline)) static void yield() {
+    if (!get_ready_count())
+      return;
+    worker *w = get_worker();
+    w->requeue = w->running;
+    switch_out(w);
+  }
+
+private:
+  struct worker {
+    std::mutex mutex;
+    fiber *head = 0;         // ready queue
+    fiber *tail = 0;
+    ucontext_t context;      // scheduling loop
+    sim_stack bounds;
+    fiber *running = 0;
+    std::unique_lock<std::mutex> *unlock = 0;
+    fiber *requeue = 0;
+    fiber *finished = 0;
+  };
+
+  __attribute__((noinline)) static worker *&get_worker() {
+    static thread_local worker *w = 0;
+    return w;
+  }
+
+  static std::vector<worker *> &get_workers() {
+    static std::vector<worker *> *workers = new std::vector<worker *>();
+    return *workers;
+  }
+
+  static std::atomic<unsigned> &get_next_worker() {
+      static std::atomic<unsigned> next(0);
+
+      return next;
+  }
+
+  static std::atomic<int> &get_ready_count() {
+      static std::atomic<int> count(0);
+
+      return count;
+  }
+
+  static std::atomic<int> &get_idle_count() {
+      static std::atomic<int> count(0);
+
+      return count;
+  }
+
+  static std::mutex &get_idle_mutex() {
+      static std::mutex *mutex = new std::mutex();
+
+      return *mutex;
+  }
+
+  static std::condition_variable &get_idle_cv() {
+      static std::condition_variable *cv = new std::condition_variable();
+
+      return *cv;
+  }
+
+  static bool start_workers() {
+    unsigned n = std::thread::hardware_concurrency();
+    if (const char *env = getenv("HLS_TASK_POOL_SIZE"))
+      n = strtoul(env, 0, 0);
+    if (!n)
+      n = 1;
+    std::vector<worker *> &all = get_workers();
+    for (unsigned i = 0; i < n; i++)
+      all.push_back(new worker());
+    for (unsigned i = 0; i < n; i++) {
+      std::thread tmp(run, all[i]);
+      int cpu = sim_topology::policy_cpu(i);
+      if (cpu >= 0)
+        sim_topology::pin(tmp.native_handle(), std::vector<int>(1, cpu));
+      tmp.detach();
+    }
+    return true;
+  }
+
+  static fiber *pop(worker *w) {
+    std::lock_guard<std::mutex> lg(w->mutex);
+    fiber *f = w->head;
+    if (f) {
+      w->head = f->next;
+      if (!f->next)
+        w->tail = 0;
+      f->next = 0;
+    }
+    return f;
+  }
+
+  /// Next fiber of w, or one stolen from the other workers
+  static fiber *take(worker *w) {
+    fiber *f = pop(w);
+    std::vector<worker *> &all = get_workers();
+    for (size_t i = 0; !f && i < all.size(); i++)
+      if (all[i] != w)
+        f = pop(all[i]);
+    if (f)
+      get_ready_count()--;
+    return f;
+  }
+
+  static void run(worker *w) {
+    get_worker() = w;
+    for (;;) {
+      fiber *f = take(w);
+      if (!f) {
+        std::unique_lock<std::mutex> ul(get_idle_mutex());
+        get_idle_count()++;
+        while (!get_ready_count())
+          get_idle_cv().wait(ul);
+        get_idle_count()--;
+        continue;
+      }
+      w->running = f;
+      auto start = std::chrono::steady_clock::now();
+      w->bounds.leave(f->bounds);
+      swapcontext(&w->context, &f->context);
+      w->bounds.enter(f->bounds);
+      w->running = 0;
+      if (task_profile *p = f->task.profile)
+        account(p, start);
+      if (w->unlock) {
+        w->unlock->unlock();
+        w->unlock = 0;
+      }
+      if (fiber *r = w->requeue) {
+        w->requeue = 0;
+        make_ready(r);
+      }
+      if (fiber *d = w->finished) {
+        w->finished = 0;
+        delete[] d->stack;
+        delete d;
+      }
+    }
+  }
+
+  static void account(task_profile *p, std::chrono::steady_clock::time_point start);
+
+  /// Give the worker back to its scheduling loop, which may resume the
+  /// fiber on another worker
+  __attribute__((noinline)) static void switch_out(worker *w, bool exiting = false) {
+    fiber *self = w->running;
+    self->bounds.leave(w->bounds, exiting);
+    swapcontext(&self->context, &w->context);
+    self->bounds.enter(get_worker()->bounds);
+  }
+
+  /// Leave a fiber whose body returned, for its worker to free it
+  __attribute__((noinline)) static void finish() {
+    worker *w = get_worker();
+    w->finished = w->running;
+    switch_out(w, true);
+  }
+
+  static void entry() {
+    current()->bounds.enter(get_worker()->bounds);
+    // Task bodies loop forever, unless their task_group stops them
+    current()->body();
+    finish();
+  }
+};
+typedef task_pool::fiber sim_fiber;
+#endif
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+/// Thrown by the blocking reads of the tasks of a stopped task_group,
+/// and caught by the task wrapper to end the task
+struct task_stopped {};
+
+/// Bookkeeping of a task_group, shared with the channels its tasks read
+struct task_group_state {
+  std::mutex mutex;
+  std::condition_variable cv;
+  int tasks = 0;                       // tasks that did not exit yet
+  int blocked = 0;                     // of which blocked on an empty channel
+  std::atomic<bool> stopping{false};
+  std::vector<std::thread> threads;    // with the default engine
+  std::vector<int> cpus;               // affinity of the tasks, if any
+
+  /// Account tasks that block (delta > 0) or are unblocked (delta < 0)
+  void add_blocked(int delta) {
+    std::lock_guard<std::mutex> lg(mutex);
+    blocked += delta;
+    if (blocked == tasks)
+      cv.notify_all();
+  }
+
+  void task_exited() {
+    std::lock_guard<std::mutex> lg(mutex);
+    tasks--;
+    cv.notify_all();
+  }
+};
+#endif
+
+/// Usage statistics of one c-sim channel, used to size
+/// '#pragma HLS STREAM depth'. They are only updated while holding the
+/// channel lock, so keeping them adds no cross-thread traffic.
+struct stream_stats {
+  /// Bucket 0 counts empty samples, bucket i counts [2^(i-1), 2^i)
+  enum { HISTOGRAM_BUCKETS = 8 * sizeof(size_t) + 1 };
+
+  unsigned long long instances;
+  unsigned long long elements;
+  unsigned long long max_size;
+  unsigned long long occupancy_sum;
+  unsigned long long samples;
+  unsigned long long producer_blocked_ns;
+  unsigned long long consumer_blocked_ns;
+  unsigned long long full_writes;        // writes that found a bounded channel full
+  unsigned long long histogram[HISTOGRAM_BUCKETS];
+
+  /// Record the occupancy observed after a read or a write
+  void sample(size_t occupancy) {
+    if (occupancy > max_size)
+      max_size = occupancy;
+    occupancy_sum += occupancy;
+    samples++;
+    histogram[bucket(occupancy)]++;
+  }
+
+  void merge(const stream_stats &s) {
+    instances += s.instances;
+    elements += s.elements;
+    if (s.max_size > max_size)
+      max_size = s.max_size;
+    occupancy_sum += s.occupancy_sum;
+    samples += s.samples;
+    producer_blocked_ns += s.producer_blocked_ns;
+    consumer_blocked_ns += s.consumer_blocked_ns;
+    full_writes += s.full_writes;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+      histogram[i] += s.histogram[i];
+  }
+
+  static unsigned bucket(size_t occupancy) {
+    if (!occupancy)
+      return 0;
+#if defined(__GNUC__)
+    return 8 * sizeof(unsigned long long) - __builtin_clzll(occupancy);
+#else
+    unsigned b = 0;
+    for (; occupancy; occupancy >>= 1)
+      b++;
+    return b;
+#endif
+  }
+
+  static unsigned long long elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+};
+
+/// Live channels created on one thread, in an intrusive list. Each thread
+/// has its own, so that the channels built and destroyed per call, such
+/// as the locals of a kernel wrapper, never wait on another thread. The
+/// reports walk the lists of all the threads.
+struct stream_registry {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  std::mutex mutex;
+#endif
+  stream_base *head;
+  stream_registry *next;         // in the list of all the registries
+  bool owned;                    // by a live thread
+
+  stream_registry() : head(0), next(0), owned(true) {}
+};
+
+/// One channel of the dataflow graph, from the tasks writing it to the
+/// tasks reading it. Instances with the same name are only merged when
+/// they connect the same tasks: the jobs of one pipeline keep their own
+/// edges.
+struct graph_edge {
+  /// Channel name, sorted writers and sorted readers
+  typedef std::tuple<std::string, std::vector<int>, std::vector<int> > key;
+
+  stream_stats stats;
+  unsigned long long active_ns;          // summed lifetime of the instances
+
+  graph_edge() : stats(), active_ns(0) {}
+
+  static void add(std::vector<int> &to, const std::vector<int> &from) {
+    for (int t : from)
+      if (std::find(to.begin(), to.end(), t) == to.end())
+        to.push_back(t);
+  }
+};
+
+#ifndef _MSC_VER
+/// Header of a stream trace file, followed by fixed-size records made
+/// of a 64-bit sequence number, a 64-bit timestamp in ns when
+/// TIMESTAMPS is set, and the raw element bytes.
+struct stream_trace_header {
+  enum { VERSION = 1, TIMESTAMPS = 1 };
+  char magic[8];
+  uint32_t version;
+  uint32_t elem_size;
+  uint32_t flags;
+  uint32_t reserved;
+  uint64_t count;
+};
+
+/// Append-only, memory-mapped trace of the elements written to a stream.
+/// Streams with the same name share one trace, so a kernel called many
+/// times produces a single file.
+class stream_trace {
+public:
+  stream_trace(int fd, const std::string &path, size_t elem_size, bool timestamps)
+    : path(path), fd(fd), map(0), capacity(0), elem_size(elem_size),
+      record_size(8 + (timestamps ? 8 : 0) + elem_size) {
+    if (!grow(sizeof(stream_trace_header) + 1024 * record_size))
+      return;
+    stream_trace_header *h = header();
+    memcpy(h->magic, "HLSTRACE", 8);
+    h->version = stream_trace_header::VERSION;
+    h->elem_size = elem_size;
+    h->flags = timestamps ? stream_trace_header::TIMESTAMPS : 0;
+    h->count = 0;
+  }
+
+  void append(const void *elem) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    if (!map)
+      return;
+    uint64_t seq = header()->count;
+    size_t offset = sizeof(stream_trace_header) + seq * record_size;
+    if (offset + record_size > capacity && !grow(capacity * 2))
+      return;
+    char *rec = map + offset;
+    memcpy(rec, &seq, 8);
+    if (header()->flags & stream_trace_header::TIMESTAMPS) {
+      uint64_t ts = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+      memcpy(rec + 8, &ts, 8);
+    }
+    memcpy(rec + record_size - elem_size, elem, elem_size);
+    // Committed last, so a crashed run leaves a readable prefix
+    header()->count = seq + 1;
+  }
+
+  /// Unmap and cut the file to the records written
+  void close() {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    if (!map)
+      return;
+    size_t length = sizeof(stream_trace_header) + header()->count * record_size;
+    munmap(map, capacity);
+    map = 0;
+    if (ftruncate(fd, length) != 0)
+      std::cout << "WARNING [HLS SIM]: cannot truncate stream trace '" << path << "'." << std::endl;
+    ::close(fd);
+  }
+
+  const std::string path;
+
+  size_t get_elem_size() const { return elem_size; }
+
+private:
+  stream_trace_header *header() {
+    return reinterpret_cast<stream_trace_header *>(map);
+  }
+
+  bool grow(size_t size) {
+    if (map)
+      munmap(map, capacity);
+    map = 0;
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+      p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      std::cout << "WARNING [HLS SIM]: cannot extend stream trace '" << path
+                << "', recording stopped." << std::endl;
+      return false;
+    }
+    map = static_cast<char *>(p);
+    capacity = size;
+    return true;
+  }
+
+  int fd;
+  char *map;
+  size_t capacity;
+  size_t elem_size;
+  size_t record_size;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  std::mutex mutex;
+#endif
+};
+
+/// Read side of a stream trace, used to feed a stream in replay mode
+class stream_replay {
+public:
+  stream_replay(const char *file, size_t elem_size) : pos(0) {
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(stream_trace_header))
+      p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd >= 0)
+      ::close(fd);
+    if (p == MAP_FAILED) {
+      std::cerr << "ERROR: cannot open stream trace '" << file << "'." << std::endl;
+      abort();
+    }
+    map = static_cast<const char *>(p);
+    length = st.st_size;
+    const stream_trace_header *h = reinterpret_cast<const stream_trace_header *>(map);
+    if (memcmp(h->magic, "HLSTRACE", 8) || h->version != stream_trace_header::VERSION ||
+        h->elem_size != elem_size) {
+      std::cerr << "ERROR: '" << file << "' is not a trace of elements of "
+                << elem_size << " bytes." << std::endl;
+      abort();
+    }
+    this->elem_size = elem_size;
+    record_size = 8 + (h->flags & stream_trace_header::TIMESTAMPS ? 8 : 0) + elem_size;
+    count = h->count;
+    if (sizeof(stream_trace_header) + count * record_size > length)
+      count = (length - sizeof(stream_trace_header)) / record_size;
+  }
+
+  ~stream_replay() {
+    munmap(const_cast<char *>(map), length);
+  }
+
+  /// Copy the next recorded element, false at the end of the trace
+  bool next(void *elem) {
+    if (pos == count)
+      return false;
+    const char *rec = map + sizeof(stream_trace_header) + pos++ * record_size;
+    memcpy(elem, rec + record_size - elem_size, elem_size);
+    return true;
+  }
+
+private:
+  const char *map;
+  size_t length;
+  size_t elem_size;
+  size_t record_size;
+  uint64_t count;
+  uint64_t pos;
+};
+#endif
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+/// Where an hls::task spends its time, kept when the HLS_TASK_PROFILE
+/// environment variable (or macro) is set. Busy time is time on a core:
+/// the thread CPU clock, or the time between fiber switches. The blocked
+/// time is charged to the channel waited on, which points at the task on
+/// the other end. The rest of the lifetime was spent waiting for a core.
+struct task_profile {
+  struct edge {
+    std::string name;
+    int peer;                  // writer of a channel read, reader of a channel written
+    uint64_t read_ns;
+    uint64_t write_ns;
+  };
+
+  int task;
+  std::chrono::steady_clock::time_point start;
+  std::atomic<uint64_t> lifetime_ns{0};  // once the task exited
+  std::atomic<uint64_t> iterations{0};
+  std::atomic<uint64_t> read_blocked_ns{0};
+  std::atomic<uint64_t> write_blocked_ns{0};
+  std::atomic<uint64_t> run_ns{0};       // kept by the fiber engines
+#if defined(__linux__) && !defined(HLS_TASK_COROUTINE_SIM) && !defined(HLS_TASK_POOL_SIM)
+  clockid_t cpu_clock;                   // of the task thread, while it runs
+  std::atomic<bool> running{false};
+#endif
+  std::mutex mutex;
+  // By channel address: channels created later at the same address,
+  // usually the same channel of the next job, share the entry
+  std::unordered_map<const stream_base *, edge> edges;
+
+  /// Created by the task itself, when it starts
+  explicit task_profile(int id) : task(id), start(std::chrono::steady_clock::now()) {
+#if defined(__linux__) && !defined(HLS_TASK_COROUTINE_SIM) && !defined(HLS_TASK_POOL_SIM)
+    running = !pthread_getcpuclockid(pthread_self(), &cpu_clock);
+#endif
+  }
+
+  void blocked(const stream_base *s, uint64_t ns, bool write);
+
+  uint64_t busy_ns() {
+#if defined(__linux__) && !defined(HLS_TASK_COROUTINE_SIM) && !defined(HLS_TASK_POOL_SIM)
+    struct timespec ts;
+    if (running && !clock_gettime(cpu_clock, &ts))
+      return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    return run_ns;
+  }
+
+  void exited() {
+    lifetime_ns = stream_stats::elapsed_ns(start);
+#if defined(__linux__) && !defined(HLS_TASK_COROUTINE_SIM) && !defined(HLS_TASK_POOL_SIM)
+    run_ns = busy_ns();
+    running = false;
+#endif
+  }
+};
+#endif
+
+class stream_globals {
+public:
+  static void print_max_size() {
+#ifndef DISABLE_MAX_HLS_STREAM_DEPTH_PRINT
+    std::cout << "INFO [HLS SIM]: The maximum depth reached by any hls::stream() instance in the design is " << get_max_size() << std::endl;
+#endif
+    dump_stream_stats();
+    dump_dataflow_graph();
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    report_task_profiles();
+#endif
+  }
+
+  static int incr_task_counter() {
+    get_task_counter()++;
+    return ++get_task_ids();
+  }
+
+  static void decr_task_counter() {
+    get_task_counter()--;
+  }
+
+  /// True while hls::tasks run concurrently with the testbench
+  static bool tasks_running() {
+    return get_task_counter() > 0;
+  }
+
+  /// State of the hls::task run by the calling thread
+  static task_context &current_context() {
+#ifdef HLS_TASK_COROUTINE_SIM
+    return coroutine_scheduler::current()->task;
+#else
+#ifdef HLS_TASK_POOL_SIM
+    if (task_pool::fiber *f = task_pool::current())
+      return f->task;
+#endif
+    static thread_local task_context context;
+    return context;
+#endif
+  }
+
+  /// Identifier of the hls::task run by the calling thread, 0 for the testbench
+  static int &current_task() {
+    return current_context().id;
+  }
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  /// task_group of the hls::task run by the calling thread, if any
+  static task_group_state *&current_group() {
+    return current_context().group;
+  }
+
+  /// Innermost task_group alive on the calling thread, which the tasks
+  /// it creates join
+  static task_group_state *&active_group() {
+    static thread_local task_group_state *group = 0;
+    return group;
+  }
+
+  /// Wake up the tasks of g blocked on a channel, so that they stop
+  static void wake_group(task_group_state *g);
+
+  static bool task_profiling() {
+    static bool on = init_task_profiling();
+    return on;
+  }
+
+  /// Profile of a starting task, kept until exit
+  static task_profile *new_profile(int task) {
+    task_profile *p = new task_profile(task);
+    std::lock_guard<std::mutex> lg(get_mutex());
+    get_profiles().push_back(p);
+    return p;
+  }
+
+  /// Rank the tasks by utilization, and print the longest chain of tasks
+  /// waiting on each other, which ends at the task limiting throughput
+  static void report_task_profiles();
+#endif
+
+  /// Account readers that block (delta > 0) or are unblocked (delta < 0).
+  /// In cosim, on a single thread or with the coroutine engine, every
+  /// producer is known: a deadlock is reported as soon as the last
+  /// runnable thread blocks; 'locked' is the channel whose lock the caller
+  /// holds, if any. The thread and pool engines cannot see the plain
+  /// threads of a testbench, so a watchdog only reports a deadlock that
+  /// lasts (see get_deadlock_timeout()).
+  static void add_blocked(int delta, stream_base *locked = 0) {
+    int blocked = (get_blocked_counter() += delta);
+#if defined(__HLS_COSIM__) || defined(HLS_STREAM_THREAD_UNSAFE) || defined(HLS_TASK_COROUTINE_SIM)
+    if (delta > 0 && check_deadlock(blocked))
+      report_deadlock(locked);
+#else
+    (void)locked;
+    if (delta < 0)
+      get_unblocks()++;
+    else if (check_deadlock(blocked))
+      start_deadlock_watchdog();
+#endif
+  }
+
+  static void start_threads() {
+    // These initializations must be in ONE static function that is called elsewhere.
+    // A function-local static keeps the per-access cost to a plain load.
+    static bool init_done = init_threads();
+    (void)init_done;
+  }
+
+  /// Default number of spin iterations of a blocking read before the
+  /// reader parks: HLS_STREAM_SPIN_COUNT from the environment or macro,
+  /// otherwise a few microseconds on multi-core hosts and none on a
+  /// single core, where spinning only delays the producer.
+  static unsigned get_spin_count() {
+    static unsigned count = init_spin_count();
+    return count;
+  }
+
+  static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+  }
+
+  /// Largest occupancy reached by any channel, live or destroyed
+  static size_t get_max_size();
+
+  /// Write the per-channel statistics as JSON to the file named by the
+  /// HLS_STREAM_STATS_FILE environment variable (or macro), if any.
+  static void dump_stream_stats();
+
+  /// Write the graph of tasks and channels, annotated with the measured
+  /// throughput and occupancy, to <prefix>.dot and <prefix>.json, where
+  /// the prefix comes from the HLS_DATAFLOW_GRAPH environment variable
+  /// (or macro), if any.
+  static void dump_dataflow_graph();
+
+#ifndef _MSC_VER
+  /// Directory where every stream records its traffic, from the
+  /// HLS_STREAM_RECORD_DIR environment variable, or null
+  static const char *get_record_dir() {
+    static const char *dir = getenv("HLS_STREAM_RECORD_DIR");
+    return dir;
+  }
+
+  /// Trace shared by all the streams recording to 'path'
+  static stream_trace *open_trace(const std::string &path, size_t elem_size,
+                                  bool timestamps);
+#endif
+
+  /// Channel registry, maintained by stream_base
+  static void register_stream(stream_base *s);
+  static void unregister_stream(stream_base *s);
+
+  /// Call f on every live channel, with each registry locked in turn. The
+  /// caller holds get_mutex(): the order is get_mutex(), a registry, then
+  /// a channel lock.
+  template<typename F>
+  static void for_each_stream(F f);
+
+  /// Queue chunks taken from the heap, and recycled through the chunk pools
+  static std::atomic<unsigned long long> &get_chunk_allocs() {
+      static std::atomic<unsigned long long> allocs(0);
+
+      return allocs;
+  }
+
+  static std::atomic<unsigned long long> &get_chunk_reuses() {
+      static std::atomic<unsigned long long> reuses(0);
+
+      return reuses;
+  }
+
+private:
+#ifdef HLS_TASK_COROUTINE_SIM
+  friend class coroutine_scheduler;
+#endif
+
+  static bool init_threads() {
+    // Perform global initialization actions once
+    // Register function executed at exit
+    std::atexit(print_max_size);
+    return true;
+  }
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  static bool init_task_profiling() {
+    const char *env = getenv("HLS_TASK_PROFILE");
+    if (env)
+      return *env && strcmp(env, "0");
+#ifdef HLS_TASK_PROFILE
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  static std::vector<task_profile *> &get_profiles() {
+    static std::vector<task_profile *> *profiles = new std::vector<task_profile *>();
+    return *profiles;
+  }
+#endif
+
+  static unsigned init_spin_count() {
+    const char *env = getenv("HLS_STREAM_SPIN_COUNT");
+    if (env)
+      return strtoul(env, 0, 0);
+#ifdef HLS_STREAM_SPIN_COUNT
+    return HLS_STREAM_SPIN_COUNT;
+#else
+    return std::thread::hardware_concurrency() > 1 ? 4000 : 0;
+#endif
+  }
+
+  static bool check_deadlock(int blocked) {
+    // Check that it is larger than, because the testbench main thread is not counted.
+    // Without tasks, an empty read only hangs for sure in RTL cosim or
+    // when a single thread is simulated.
+#if defined(__HLS_COSIM__) || defined(HLS_STREAM_THREAD_UNSAFE)
+    return blocked > get_task_counter();
+#else
+    return get_task_counter() && blocked > get_task_counter();
+#endif
+  }
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  static std::mutex &get_mutex() {
+      static std::mutex *mutex = new std::mutex();
+
+      return *mutex;
+  }
+#endif
+
+  static void report_deadlock(stream_base *locked = 0);
+
+#if !defined(__HLS_COSIM__) && !defined(HLS_STREAM_THREAD_UNSAFE) && !defined(HLS_TASK_COROUTINE_SIM)
+  /// Readers and writers unblocked so far: the watchdog sees progress
+  static std::atomic<unsigned long long> &get_unblocks() {
+    static std::atomic<unsigned long long> unblocks(0);
+    return unblocks;
+  }
+
+  /// How long every thread must stay blocked, without any of them being
+  /// unblocked, before the watchdog reports a deadlock:
+  /// HLS_STREAM_DEADLOCK_TIMEOUT in ms from the environment or macro,
+  /// 1000 by default
+  static std::chrono::milliseconds get_deadlock_timeout() {
+    static std::chrono::milliseconds timeout(init_deadlock_timeout());
+    return timeout;
+  }
+
+  static unsigned long init_deadlock_timeout() {
+    const char *env = getenv("HLS_STREAM_DEADLOCK_TIMEOUT");
+    if (env)
+      return strtoul(env, 0, 0);
+#ifdef HLS_STREAM_DEADLOCK_TIMEOUT
+    return HLS_STREAM_DEADLOCK_TIMEOUT;
+#else
+    return 1000;
+#endif
+  }
+
+  /// Started the first time every thread looks blocked, and then polls
+  static void start_deadlock_watchdog() {
+    static bool started = init_deadlock_watchdog();
+    (void)started;
+  }
+
+  static bool init_deadlock_watchdog() {
+    std::thread(deadlock_watchdog).detach();
+    return true;
+  }
+
+  static void deadlock_watchdog() {
+    unsigned long long last = 0;
+    bool suspect = false;
+    for (;;) {
+      std::this_thread::sleep_for(get_deadlock_timeout());
+      unsigned long long unblocks = get_unblocks();
+      bool stuck = check_deadlock(get_blocked_counter());
+      // Blocked for a whole period, and at its start already
+      if (stuck && suspect && unblocks == last)
+        report_deadlock();
+      suspect = stuck;
+      last = unblocks;
+    }
+  }
+#endif
+
+  static std::atomic<int> &get_task_counter() {
+      static std::atomic<int> task_counter(0);
+
+      return task_counter;
+  }
+
+  static std::atomic<int> &get_task_ids() {
+      static std::atomic<int> task_ids(0);
+
+      return task_ids;
+  }
+
+  static std::atomic<int> &get_blocked_counter() {
+      static std::atomic<int> blocked_counter(0);
+
+      return blocked_counter;
+  }
+
+  static const char *get_stats_file() {
+    static const char *file = getenv("HLS_STREAM_STATS_FILE");
+#ifdef HLS_STREAM_STATS_FILE
+    if (!file)
+      file = HLS_STREAM_STATS_FILE;
+#endif
+    return file;
+  }
+
+  static const char *get_graph_prefix() {
+    static const char *prefix = getenv("HLS_DATAFLOW_GRAPH");
+#ifdef HLS_DATAFLOW_GRAPH
+    if (!prefix)
+      prefix = HLS_DATAFLOW_GRAPH;
+#endif
+    return prefix;
+  }
+
+  /// Head of the list of the registries of all the threads
+  static stream_registry *&get_registries() {
+    static stream_registry *head = 0;
+    return head;
+  }
+
+  /// Registry of the calling thread. A thread that exits leaves its
+  /// registry, with the channels that outlive it, to the next new thread.
+  static stream_registry *local_registry() {
+#ifdef HLS_STREAM_THREAD_UNSAFE
+    static stream_registry *r = adopt_registry();
+    return r;
+#else
+    struct owner {
+      stream_registry *r;
+      owner() : r(adopt_registry()) {}
+      ~owner() {
+        std::lock_guard<std::mutex> lg(get_mutex());
+        r->owned = false;
+      }
+    };
+    static thread_local owner o;
+    return o.r;
+#endif
+  }
+
+  static stream_registry *adopt_registry() {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(get_mutex());
+#endif
+    for (stream_registry *r = get_registries(); r; r = r->next)
+      if (!r->owned) {
+        r->owned = true;
+        return r;
+      }
+    stream_registry *r = new stream_registry();
+    r->next = get_registries();
+    get_registries() = r;
+    return r;
+  }
+
+  /// High-water mark of destroyed channels
+  static std::atomic<size_t> &get_retired_max_size() {
+    static std::atomic<size_t> max_size(0);
+    return max_size;
+  }
+
+  /// Statistics of destroyed channels, merged by name. Only kept when a
+  /// stats file is requested, so long runs do not accumulate memory.
+  static std::map<std::string, stream_stats> &get_retired_stats() {
+    static std::map<std::string, stream_stats> *stats =
+        new std::map<std::string, stream_stats>();
+    return *stats;
+  }
+
+  /// Edges of destroyed channels, only kept when a graph is requested
+  static std::map<graph_edge::key, graph_edge> &get_retired_edges() {
+    static std::map<graph_edge::key, graph_edge> *edges =
+        new std::map<graph_edge::key, graph_edge>();
+    return *edges;
+  }
+
+  static void add_edge(std::map<graph_edge::key, graph_edge> &edges,
+                       const stream_base *s, const stream_stats &stats);
+  static std::string task_name(int id);
+  static void print_task(int id);
+#ifndef _MSC_VER
+  static std::map<std::string, stream_trace *> &get_traces() {
+    static std::map<std::string, stream_trace *> *traces =
+        new std::map<std::string, stream_trace *>();
+    return *traces;
+  }
+  static void close_traces();
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  static std::mutex &get_trace_mutex() {
+      static std::mutex *mutex = new std::mutex();
+
+      return *mutex;
+  }
+#endif
+#endif
+  static void collect_stats(std::map<std::string, stream_stats> &all);
+  static void print_json_string(std::ostream &os, const std::string &s);
+  static void print_dot_string(std::ostream &os, const std::string &s);
+
+  static void print_json_array(std::ostream &os, const std::vector<int> &v) {
+    os << '[';
+    for (size_t i = 0; i < v.size(); i++)
+      os << (i ? ", " : "") << v[i];
+    os << ']';
+  }
+
+  static std::string dot_node(int task) {
+    return task < 0 ? "nobody" : "n" + std::to_string(task);
+  }
+};
+
+/// Type independent part of every c-sim channel: name, lock and usage
+/// statistics. Live channels are registered in the stream_registry of
+/// the thread creating them, so that the exit reports can see them.
+class stream_base {
+public:
+#ifdef HLS_STREAM_THREAD_UNSAFE
+  stream_base() : name(name_buf), name_type(0), name_id(0), stats(),
+                  waiting_readers(0), waiting_writers(0), capacity(0), blocked(0), occupancy(0),
+                  last_reader(-1), last_writer(-1),
+                  created(std::chrono::steady_clock::now()), registry(0), prev(0), next(0) {
+#else
+  stream_base() : name(name_buf), name_type(0), name_id(0), stats(),
+                  invalid(false), parked(0),
+#if defined(HLS_TASK_COROUTINE_SIM) || defined(HLS_TASK_POOL_SIM)
+                  waiters_head(0), waiters_tail(0),
+#endif
+                  spin_max(stream_globals::get_spin_count()),
+                  spin_limit(spin_max), waiting_readers(0), waiting_writers(0),
+                  capacity(0), blocked(0),
+                  reader_group(0), reader_node(-1), occupancy(0), last_reader(-1), last_writer(-1),
+                  created(std::chrono::steady_clock::now()), registry(0), prev(0), next(0) {
+#endif
+    name_buf[0] = 0;
+    stats.instances = 1;
+    stream_globals::register_stream(this);
+  }
+
+  ~stream_base() {
+    stream_globals::unregister_stream(this);
+    if (name != name_buf)
+      free(name);
+  }
+
+  /// Set name for c-sim debugging. Short names are copied in place, so
+  /// naming a channel does not allocate.
+  void set_name(const char *n) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    init_name(n);
+  }
+
+  /// Name a channel that is not shared yet, without locking
+  void init_name(const char *n) {
+    if (name != name_buf)
+      free(name);
+    size_t len = strlen(n);
+    if (len < sizeof(name_buf)) {
+      memcpy(name_buf, n, len + 1);
+      name = name_buf;
+    } else {
+      name = strdup(n);
+    }
+    name_type = 0;
+  }
+
+  /// Default name: the channel type followed by a sequence number. It is
+  /// only formatted when a message or a report asks for get_name().
+  void init_name(const std::type_info &type, unsigned id) {
+    name_type = &type;
+    name_id = id;
+  }
+
+  std::string get_name() const {
+    if (!name_type)
+      return name;
+    std::string n;
+#ifndef _MSC_VER
+    char *demangled = abi::__cxa_demangle(name_type->name(), 0, 0, 0);
+    if (demangled) {
+      n = demangled;
+      free(demangled);
+    } else {
+      n = "hls_stream";
+    }
+#else
+    n = name_type->name();
+#endif
+    return n + std::to_string(name_id);
+  }
+
+  /// Copy of the statistics, taken under the channel lock
+  virtual stream_stats get_stats() {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    return stats;
+  }
+
+  /// Wait-for bookkeeping of the deadlock detector, called under the
+  /// channel lock. A waiting reader only counts as blocked while the
+  /// channel holds fewer elements than there are readers waiting on it,
+  /// so the writer unblocks it before the reader even wakes up. Writers
+  /// of a bounded channel wait for room the same way.
+  void begin_wait(bool write = false) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    // Blocked tasks are accounted to the task_group of the first one,
+    // and the queue is placed on the NUMA node of the first reader
+    if (!waiting_readers && !waiting_writers)
+      reader_group = stream_globals::current_group();
+    if (!write && !waiting_readers && sim_topology::node_count() > 1)
+      reader_node = sim_topology::current_node();
+#endif
+    if (write) {
+      waiting_writers++;
+      seen(last_writer, writers, stream_globals::current_task());
+    } else {
+      waiting_readers++;
+      seen(last_reader, readers, stream_globals::current_task());
+    }
+    update_blocked(occupancy.load(std::memory_order_relaxed));
+  }
+
+  void end_wait(bool write = false) {
+    (write ? waiting_writers : waiting_readers)--;
+    update_blocked(occupancy.load(std::memory_order_relaxed));
+  }
+
+  void wrote(size_t size) {
+    seen(last_writer, writers, stream_globals::current_task());
+    update_blocked(size);
+  }
+
+  void consumed(size_t size) {
+    seen(last_reader, readers, stream_globals::current_task());
+    update_blocked(size);
+  }
+
+  /// Track the task at one end of the channel, and every distinct one
+  /// seen there, which only costs a comparison while it does not change
+  static void seen(int &last, std::vector<int> &all, int task) {
+    if (task == last)
+      return;
+    last = task;
+    if (std::find(all.begin(), all.end(), task) == all.end())
+      all.push_back(task);
+  }
+
+  /// Record that hls::task 'id' received this channel, for the dataflow
+  /// graph (see HLS_DATAFLOW_GRAPH)
+  void attach_task(int id) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    if (std::find(tasks.begin(), tasks.end(), id) == tasks.end())
+      tasks.push_back(id);
+  }
+
+  /// Time a reader waited for data, or a writer for the channel
+  void consumer_blocked(uint64_t ns) {
+    stats.consumer_blocked_ns += ns;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    if (task_profile *p = stream_globals::current_context().profile)
+      p->blocked(this, ns, false);
+#endif
+  }
+
+  void producer_blocked(uint64_t ns) {
+    stats.producer_blocked_ns += ns;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    if (task_profile *p = stream_globals::current_context().profile)
+      p->blocked(this, ns, true);
+#endif
+  }
+
+  void update_blocked(size_t size) {
+    occupancy.store(size, std::memory_order_relaxed);
+    size_t now = waiting_readers > size ? waiting_readers - size : 0;
+    if (capacity) {
+      size_t room = capacity > size ? capacity - size : 0;
+      now += waiting_writers > room ? waiting_writers - room : 0;
+    }
+    if (now != blocked) {
+      int delta = (int)now - (int)blocked;
+      blocked = now;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      if (reader_group)
+        reader_group->add_blocked(delta);
+#endif
+      stream_globals::add_blocked(delta, this);
+    }
+  }
+
+#ifdef HLS_STREAM_THREAD_UNSAFE
+  /// Wait until ready() holds. Nothing can make it hold in a single
+  /// thread, so this only returns through the deadlock report.
+  template<typename Ready>
+  void wait_readable(Ready ready) {
+    begin_wait();
+    while (!ready()) {}
+    end_wait();
+  }
+#else
+  /// Wait until ready() holds, with the channel lock held on entry and
+  /// exit. The reader first spins for a bounded number of iterations,
+  /// which avoids two context switches per element in a pipeline running
+  /// near empty, then parks on the condition variable (a futex on Linux).
+  template<typename Ready>
+  void wait_readable(std::unique_lock<std::mutex> &ul, Ready ready) {
+    wait_until(ul, ready, false);
+  }
+
+  /// Wait until a bounded channel has room for the writer. Channels
+  /// are never empty and full at once, so readers and writers share the
+  /// waiters: notify_reader() wakes whichever end is parked.
+  template<typename Ready>
+  void wait_writable(std::unique_lock<std::mutex> &ul, Ready ready) {
+    wait_until(ul, ready, true);
+  }
+
+  template<typename Ready>
+  void wait_until(std::unique_lock<std::mutex> &ul, Ready ready, bool write) {
+#ifdef HLS_TASK_COROUTINE_SIM
+    // Spinning cannot help on a single thread: switch to a ready task
+    begin_wait(write);
+    while (!ready()) {
+      check_stopped(write);
+      add_waiter(coroutine_scheduler::current());
+      parked++;
+      ul.unlock();
+      coroutine_scheduler::suspend();
+      ul.lock();
+      parked--;
+      if (invalid) {
+        // Woken up by the destructor: never run again
+        ul.unlock();
+        for (;;)
+          coroutine_scheduler::suspend();
+      }
+    }
+    end_wait(write);
+#else
+#ifdef HLS_TASK_POOL_SIM
+    if (task_pool::fiber *self = task_pool::current()) {
+      // Switching fibers is cheaper than spinning, and frees the worker
+      begin_wait(write);
+      while (!ready()) {
+        check_stopped(write);
+        add_waiter(self);
+        task_pool::park(&ul);
+        ul.lock();
+        if (invalid) {
+          // Woken up by the destructor: never run again
+          ul.unlock();
+          task_pool::park(0);
+        }
+      }
+      end_wait(write);
+      return;
+    }
+#endif
+    // The spin only watches for data
+    if (!write && spin(ul, ready))
+      return;
+    begin_wait(write);
+    while (!ready()) {
+      check_stopped(write);
+      while (invalid) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+      }
+      parked++;
+      condition_var.wait(ul);
+      parked--;
+    }
+    end_wait(write);
+#endif
+  }
+
+  /// Wake up a parked reader, or the writer of a full bounded channel,
+  /// called under the channel lock. Spinning readers see the new
+  /// occupancy without a system call.
+  void notify_reader() {
+#ifdef HLS_TASK_COROUTINE_SIM
+    if (sim_fiber *c = pop_waiter())
+      coroutine_scheduler::make_ready(c);
+#else
+#ifdef HLS_TASK_POOL_SIM
+    if (sim_fiber *f = pop_waiter())
+      task_pool::make_ready(f);
+    else
+#endif
+    if (parked)
+      condition_var.notify_one();
+#endif
+  }
+
+  /// Wake up every parked reader, when the channel is destroyed or its
+  /// task_group stops. The fibers waiting on a destroyed channel are
+  /// dropped instead: they would only relock the freed channel.
+  void notify_all_readers() {
+#ifdef HLS_TASK_COROUTINE_SIM
+    while (sim_fiber *c = pop_waiter())
+      if (!invalid)
+        coroutine_scheduler::make_ready(c);
+#else
+#ifdef HLS_TASK_POOL_SIM
+    while (sim_fiber *f = pop_waiter())
+      if (!invalid)
+        task_pool::make_ready(f);
+#endif
+    condition_var.notify_all();
+#endif
+  }
+
+  /// Set the maximum number of spin iterations before parking, 0 to park
+  /// immediately. The default comes from stream_globals::get_spin_count().
+  void set_spin_count(unsigned n) {
+    std::lock_guard<std::mutex> lg(mutex);
+    spin_max = spin_limit = n;
+  }
+#endif
+
+  char *name;
+  char name_buf[32];
+  const std::type_info *name_type;
+  unsigned name_id;
+  stream_stats stats;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  std::mutex mutex;
+  std::condition_variable condition_var;
+  bool invalid;
+  unsigned parked;
+#if defined(HLS_TASK_COROUTINE_SIM) || defined(HLS_TASK_POOL_SIM)
+  sim_fiber *waiters_head;
+  sim_fiber *waiters_tail;
+#endif
+  unsigned spin_max;
+  unsigned spin_limit;
+#endif
+  size_t waiting_readers;
+  size_t waiting_writers;
+  size_t capacity;               // elements, 0 when unbounded
+  size_t blocked;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  task_group_state *reader_group;
+  int reader_node;
+#endif
+  std::atomic<size_t> occupancy;
+  int last_reader;
+  int last_writer;
+  std::vector<int> readers;
+  std::vector<int> writers;
+  std::vector<int> tasks;        // hls::tasks that received the channel
+  std::chrono::steady_clock::time_point created;
+
+private:
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  /// End the calling task at this wait if its task_group is stopping
+  void check_stopped(bool write) {
+    task_group_state *g = stream_globals::current_group();
+    if (g && g->stopping.load(std::memory_order_relaxed)) {
+      end_wait(write);
+      throw task_stopped();
+    }
+  }
+#endif
+
+#if defined(HLS_TASK_COROUTINE_SIM) || defined(HLS_TASK_POOL_SIM)
+  /// FIFO of the fibers waiting for data, under the channel lock
+  void add_waiter(sim_fiber *f) {
+    f->next = 0;
+    if (waiters_tail)
+      waiters_tail->next = f;
+    else
+      waiters_head = f;
+    waiters_tail = f;
+  }
+
+  sim_fiber *pop_waiter() {
+    sim_fiber *f = waiters_head;
+    if (f) {
+      waiters_head = f->next;
+      if (!waiters_head)
+        waiters_tail = 0;
+    }
+    return f;
+  }
+#endif
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  /// Spin phase of wait_readable(). The spin limit adapts to the channel:
+  /// it doubles after a successful spin and halves after a useless one.
+  template<typename Ready>
+  bool spin(std::unique_lock<std::mutex> &ul, Ready ready) {
+    unsigned limit = spin_limit;
+    if (!limit)
+      return false;
+    ul.unlock();
+    for (unsigned i = 0; i < limit && !occupancy.load(std::memory_order_relaxed); i++)
+      stream_globals::cpu_relax();
+    ul.lock();
+    bool done = ready();
+    unsigned floor = spin_max < 16 ? spin_max : 16;
+    if (done)
+      spin_limit = limit * 2 < spin_max ? limit * 2 : spin_max;
+    else
+      spin_limit = limit / 2 > floor ? limit / 2 : floor;
+    return done;
+  }
+#endif
+
+  friend class stream_globals;
+  stream_registry *registry;
+  stream_base *prev;
+  stream_base *next;
+};
+
+#ifdef HLS_TASK_COROUTINE_SIM
+inline void coroutine_scheduler::suspend() {
+  coroutine *c = pop_ready();
+  if (!c)
+    stream_globals::report_deadlock();
+  switch_to(c);
+}
+#endif
+
+inline void stream_globals::register_stream(stream_base *s) {
+  stream_registry *r = local_registry();
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  std::lock_guard<std::mutex> lg(r->mutex);
+#endif
+  s->registry = r;
+  s->next = r->head;
+  if (r->head)
+    r->head->prev = s;
+  r->head = s;
+}
+
+inline void stream_globals::unregister_stream(stream_base *s) {
+  // Not taken under the channel lock: a reader woken by the destructor of
+  // the derived class may keep holding it
+  const stream_stats &stats = s->stats;
+  std::atomic<size_t> &max_size = get_retired_max_size();
+  for (size_t m = max_size.load(); stats.max_size > m; )
+    if (max_size.compare_exchange_weak(m, stats.max_size))
+      break;
+
+  // The statistics are retired along with the channel, when kept
+  bool keep_stats = get_stats_file() && stats.samples;
+  bool keep_edge = get_graph_prefix() && (stats.samples || !s->tasks.empty());
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  std::unique_lock<std::mutex> ul(get_mutex(), std::defer_lock);
+  if (keep_stats || keep_edge)
+    ul.lock();
+  std::lock_guard<std::mutex> lg(s->registry->mutex);
+#endif
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    s->registry->head = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+
+  if (keep_stats)
+    get_retired_stats()[s->get_name()].merge(stats);
+  if (keep_edge)
+    add_edge(get_retired_edges(), s, stats);
+}
+
+template<typename F>
+inline void stream_globals::for_each_stream(F f) {
+  for (stream_registry *r = get_registries(); r; r = r->next) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(r->mutex);
+#endif
+    for (stream_base *s = r->head; s; s = s->next)
+      f(s);
+  }
+}
+
+inline size_t stream_globals::get_max_size() {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  std::lock_guard<std::mutex> lg(get_mutex());
+#endif
+  size_t max_size = get_retired_max_size();
+  for_each_stream([&](stream_base *s) {
+    stream_stats stats = s->get_stats();
+    if (stats.max_size > max_size)
+      max_size = stats.max_size;
+  });
+  return max_size;
+}
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+inline void stream_globals::wake_group(task_group_state *g) {
+  std::lock_guard<std::mutex> lg(get_mutex());
+  for_each_stream([g](stream_base *s) {
+    std::lock_guard<std::mutex> slg(s->mutex);
+    if ((s->waiting_readers || s->waiting_writers) && s->reader_group == g)
+      s->notify_all_readers();
+  });
+}
+#endif
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+#ifdef HLS_TASK_COROUTINE_SIM
+inline void coroutine_scheduler::account(task_profile *p) {
+  auto now = std::chrono::steady_clock::now();
+  p->run_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(now - get_switch_time()).count();
+  get_switch_time() = now;
+}
+#endif
+
+#ifdef HLS_TASK_POOL_SIM
+inline void task_pool::account(task_profile *p, std::chrono::steady_clock::time_point start) {
+  p->run_ns += stream_stats::elapsed_ns(start);
+}
+#endif
+
+inline void task_profile::blocked(const stream_base *s, uint64_t ns, bool write) {
+  (write ? write_blocked_ns : read_blocked_ns).fetch_add(ns, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lg(mutex);
+  auto it = edges.find(s);
+  if (it == edges.end())
+    it = edges.insert(std::make_pair(s, edge{s->get_name(), 0, 0, 0})).first;
+  edge &e = it->second;
+  if (write) {
+    e.peer = s->last_reader;
+    e.write_ns += ns;
+  } else {
+    e.peer = s->last_writer;
+    e.read_ns += ns;
+  }
+}
+
+inline void stream_globals::report_task_profiles() {
+  if (!task_profiling())
+    return;
+  struct row {
+    task_profile *p;
+    double wall, busy, read, write;
+    const task_profile::edge *top;     // channel waited on the most
+    int next;                          // row of the task at its other end
+  };
+  std::vector<row> rows;
+  std::lock_guard<std::mutex> lg(get_mutex());
+  for (task_profile *p : get_profiles()) {
+    row r;
+    r.p = p;
+    uint64_t lifetime = p->lifetime_ns;
+    r.wall = lifetime ? lifetime : stream_stats::elapsed_ns(p->start);
+    if (r.wall <= 0)
+      r.wall = 1;
+    r.read = p->read_blocked_ns / r.wall;
+    r.write = p->write_blocked_ns / r.wall;
+    r.busy = p->busy_ns() / r.wall;
+    r.top = 0;
+    r.next = -1;
+    std::lock_guard<std::mutex> plg(p->mutex);
+    for (auto &entry : p->edges)
+      if (!r.top || entry.second.read_ns + entry.second.write_ns >
+                    r.top->read_ns + r.top->write_ns)
+        r.top = &entry.second;
+    rows.push_back(r);
+  }
+  if (rows.empty())
+    return;
+  std::sort(rows.begin(), rows.end(),
+            [](const row &a, const row &b) { return a.busy > b.busy; });
+  // A task is throttled by the other end of a channel when it waits on
+  // that channel longer than it runs
+  for (row &r : rows)
+    for (size_t i = 0; r.top && i < rows.size(); i++)
+      if (rows[i].p->task == r.top->peer &&
+          r.top->read_ns + r.top->write_ns > r.busy * r.wall)
+        r.next = (int)i;
+
+  std::cout << "INFO [HLS SIM]: hls::task profile, by utilization:" << std::endl;
+  std::cout.setf(std::ios::fixed);
+  std::cout.precision(1);
+  for (row &r : rows) {
+    std::cout << "  ";
+    print_task(r.p->task);
+    std::cout << ": " << 100 * r.busy << "% busy, "
+              << 100 * r.read << "% blocked reading, "
+              << 100 * r.write << "% blocked writing, "
+              << r.p->iterations << " iterations";
+    if (r.p->iterations)
+      std::cout << ", " << r.busy * r.wall / r.p->iterations / 1000 << " us/iteration";
+    if (r.top) {
+      std::cout << "; waits most on '" << r.top->name << "' ("
+                << (r.top->read_ns >= r.top->write_ns ? "written by " : "read by ");
+      print_task(r.top->peer);
+      std::cout << ")";
+    }
+    std::cout << std::endl;
+  }
+
+  // Follow the channels waited on the most; the longest chain ends at
+  // the task that throttles the others
+  size_t best = 0, best_len = 0;
+  for (size_t i = 0; i < rows.size(); i++) {
+    size_t len = 1;
+    for (int j = rows[i].next; j >= 0 && len <= rows.size(); j = rows[j].next)
+      len++;
+    if (len > best_len) {
+      best = i;
+      best_len = len;
+    }
+  }
+  std::vector<size_t> chain(1, best);
+  for (int j = rows[best].next; j >= 0 && chain.size() < best_len; j = rows[j].next)
+    chain.push_back(j);
+  std::cout << "INFO [HLS SIM]: critical chain: ";
+  for (size_t k = chain.size(); k-- > 0; ) {
+    const row &r = rows[chain[k]];
+    if (k + 1 < chain.size())
+      std::cout << " <- ";
+    print_task(r.p->task);
+    if (k + 1 == chain.size())
+      std::cout << " (" << 100 * r.busy << "% busy)";
+    else
+      std::cout << " waiting on '" << r.top->name << "'";
+  }
+  std::cout << std::endl;
+  std::cout.unsetf(std::ios::fixed);
+  std::cout.precision(6);
+}
+#endif
+
+inline void stream_globals::report_deadlock(stream_base *locked) {
+  if (get_task_counter()) {
+      std::cout << "ERROR [HLS SIM]: deadlock detected when simulating hls::tasks." 
+              << std::endl;
+  } else {
+      std::cout << "ERROR [HLS SIM]: an hls::stream is read while empty,"
+              << " which may result in RTL simulation hanging." << std::endl;
+      std::cout << "If this is expected, add -DALLOW_EMPTY_HLS_STREAM_READS"
+              << " to -cflags to turn this error into a warning and allow empty"
+              << " hls::stream reads to return the default value for the data type."
+              << std::endl;
+  }
+
+  // Every other thread is blocked, so the channels can be inspected
+  // without their locks. The registry lock is taken before any channel
+  // lock, as in get_max_size(): drop the one held by the caller, which
+  // is never taken back since the report aborts.
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  if (locked)
+    locked->mutex.unlock();
+  std::lock_guard<std::mutex> lg(get_mutex());
+#else
+  (void)locked;
+#endif
+  std::cout << "Blocked channels:" << std::endl;
+  for_each_stream([](stream_base *s) {
+    if (!s->blocked)
+      return;
+    std::cout << "  '" << s->get_name() << "': read by ";
+    print_task(s->last_reader);
+    std::cout << ", written by ";
+    print_task(s->last_writer);
+    std::cout << ", occupancy " << s->occupancy;
+    if (s->capacity)
+      std::cout << " of " << s->capacity;
+    std::cout << std::endl;
+  });
+  std::cout << "Execute C simulation in debug mode in the GUI and examine the"
+            << " source code location of the blocked hls::stream::read()"
+            << " calls listed above to debug." << std::endl;
+  abort();
+}
+
+#ifndef _MSC_VER
+inline stream_trace *stream_globals::open_trace(const std::string &path,
+                                                size_t elem_size, bool timestamps) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  std::lock_guard<std::mutex> lg(get_trace_mutex());
+#endif
+  std::map<std::string, stream_trace *> &traces = get_traces();
+  std::map<std::string, stream_trace *>::iterator it = traces.find(path);
+  if (it != traces.end()) {
+    if (it->second->get_elem_size() == elem_size)
+      return it->second;
+    std::cout << "WARNING [HLS SIM]: stream trace '" << path
+              << "' is shared by streams of different types, not recorded." << std::endl;
+    return 0;
+  }
+
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cout << "WARNING [HLS SIM]: cannot create stream trace '" << path << "'." << std::endl;
+    return 0;
+  }
+  if (traces.empty())
+    std::atexit(close_traces);
+  return traces[path] = new stream_trace(fd, path, elem_size, timestamps);
+}
+
+inline void stream_globals::close_traces() {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  std::lock_guard<std::mutex> lg(get_trace_mutex());
+#endif
+  for (auto &entry : get_traces())
+    entry.second->close();
+}
+#endif
+
+inline std::string stream_globals::task_name(int id) {
+  if (id < 0)
+    return "nobody";
+  if (id == 0)
+    return "the testbench";
+  return "hls::task #" + std::to_string(id);
+}
+
+inline void stream_globals::print_task(int id) {
+  std::cout << task_name(id);
+}
+
+inline void stream_globals::collect_stats(std::map<std::string, stream_stats> &all) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  std::lock_guard<std::mutex> lg(get_mutex());
+#endif
+  all = get_retired_stats();
+  for_each_stream([&all](stream_base *s) {
+    stream_stats stats = s->get_stats();
+    if (stats.samples)
+      all[s->get_name()].merge(stats);
+  });
+}
+
+inline void stream_globals::print_json_string(std::ostream &os, const std::string &s) {
+  os << '"';
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\')
+      os << '\\' << c;
+    else if (c < 0x20)
+      os << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 15];
+    else
+      os << c;
+  }
+  os << '"';
+}
+
+/// Graphviz quoted string, where newlines start a new label line
+inline void stream_globals::print_dot_string(std::ostream &os, const std::string &s) {
+  os << '"';
+  for (size_t i = 0; i < s.size(); i++) {
+    char c = s[i];
+    if (c == '"' || c == '\\')
+      os << '\\' << c;
+    else if (c == '\n')
+      os << "\\n";
+    else
+      os << c;
+  }
+  os << '"';
+}
+
+inline void stream_globals::dump_stream_stats() {
+  const char *file = get_stats_file();
+  if (!file || !*file)
+    return;
+
+  std::map<std::string, stream_stats> all;
+  collect_stats(all);
+
+  std::ofstream os(file);
+  if (!os) {
+    std::cout << "WARNING [HLS SIM]: cannot write hls::stream statistics to '"
+              << file << "'." << std::endl;
+    return;
+  }
+  os << "{\n  \"streams\": [";
+  const char *sep = "\n";
+  for (auto &entry : all) {
+    const stream_stats &st = entry.second;
+    os << sep << "    {\"name\": ";
+    print_json_string(os, entry.first);
+    os << ", \"instances\": " << st.instances
+       << ", \"elements\": " << st.elements
+       << ", \"max_size\": " << st.max_size
+       << ", \"mean_occupancy\": " << (double)st.occupancy_sum / st.samples
+       << ", \"producer_blocked_ns\": " << st.producer_blocked_ns
+       << ", \"consumer_blocked_ns\": " << st.consumer_blocked_ns
+       << ", \"full_writes\": " << st.full_writes
+       << ", \"histogram\": [";
+    const char *hsep = "";
+    for (int i = 0; i < stream_stats::HISTOGRAM_BUCKETS; i++) {
+      if (!st.histogram[i])
+        continue;
+      unsigned long long lo = i ? 1ULL << (i - 1) : 0;
+      unsigned long long hi = i ? lo * 2 - 1 : 0;
+      os << hsep << "{\"min\": " << lo << ", \"max\": " << hi
+         << ", \"count\": " << st.histogram[i] << "}";
+      hsep = ", ";
+    }
+    os << "]}";
+    sep = ",\n";
+  }
+  os << "\n  ],\n  \"queue_chunks\": {\"allocated\": " << get_chunk_allocs()
+     << ", \"reused\": " << get_chunk_reuses() << "}\n}\n";
+}
+
+inline void stream_globals::add_edge(std::map<graph_edge::key, graph_edge> &edges,
+                                     const stream_base *s, const stream_stats &stats) {
+  // An end of a channel that was never used is made of the tasks it was
+  // given to, minus those at the other end, or else of nobody
+  std::vector<int> writers = s->writers, readers = s->readers;
+  std::vector<int> *ends[2] = { &writers, &readers };
+  for (int i = 0; i < 2; i++) {
+    std::vector<int> &end = *ends[i], &other = *ends[1 - i];
+    if (!end.empty())
+      continue;
+    for (int t : s->tasks)
+      if (std::find(other.begin(), other.end(), t) == other.end())
+        end.push_back(t);
+    if (end.empty())
+      end.push_back(-1);
+  }
+  std::sort(writers.begin(), writers.end());
+  std::sort(readers.begin(), readers.end());
+  graph_edge &e = edges[graph_edge::key(s->get_name(), writers, readers)];
+  e.stats.merge(stats);
+  e.active_ns += stream_stats::elapsed_ns(s->created);
+}
+
+inline void stream_globals::dump_dataflow_graph() {
+  const char *prefix = get_graph_prefix();
+  if (!prefix || !*prefix)
+    return;
+
+  std::map<graph_edge::key, graph_edge> edges;
+  {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(get_mutex());
+#endif
+    edges = get_retired_edges();
+    for_each_stream([&edges](stream_base *s) {
+      stream_stats stats = s->get_stats();
+      if (stats.samples || !s->tasks.empty())
+        add_edge(edges, s, stats);
+    });
+  }
+
+  std::map<int, double> nodes;           // task -> busy fraction, or -1
+  for (auto &entry : edges) {
+    for (int t : std::get<1>(entry.first))
+      nodes[t] = -1;
+    for (int t : std::get<2>(entry.first))
+      nodes[t] = -1;
+  }
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  if (task_profiling()) {
+    std::lock_guard<std::mutex> lg(get_mutex());
+    for (task_profile *p : get_profiles()) {
+      uint64_t wall = p->lifetime_ns ? (uint64_t)p->lifetime_ns
+                                     : stream_stats::elapsed_ns(p->start);
+      if (nodes.count(p->task) && wall)
+        nodes[p->task] = (double)p->busy_ns() / wall;
+    }
+  }
+#endif
+
+  std::string path = std::string(prefix) + ".json";
+  std::ofstream js(path.c_str());
+  path = std::string(prefix) + ".dot";
+  std::ofstream dot(path.c_str());
+  if (!js || !dot) {
+    std::cout << "WARNING [HLS SIM]: cannot write the dataflow graph to '"
+              << prefix << ".{json,dot}'." << std::endl;
+    return;
+  }
+
+  js << "{\n  \"nodes\": [";
+  dot << "digraph dataflow {\n  rankdir=LR;\n  node [shape=box];\n";
+  const char *sep = "\n";
+  for (auto &node : nodes) {
+    js << sep << "    {\"id\": " << node.first << ", \"name\": ";
+    print_json_string(js, task_name(node.first));
+    std::string label = task_name(node.first);
+    if (node.second >= 0) {
+      js << ", \"busy\": " << node.second;
+      label += "\n" + std::to_string((int)(100 * node.second + 0.5)) + "% busy";
+    }
+    js << "}";
+    dot << "  " << dot_node(node.first) << " [label=";
+    print_dot_string(dot, label);
+    dot << "];\n";
+    sep = ",\n";
+  }
+
+  js << "\n  ],\n  \"edges\": [";
+  sep = "\n";
+  for (auto &entry : edges) {
+    const std::string &name = std::get<0>(entry.first);
+    const std::vector<int> &writers = std::get<1>(entry.first);
+    const std::vector<int> &readers = std::get<2>(entry.first);
+    const graph_edge &e = entry.second;
+    const stream_stats &st = e.stats;
+    double seconds = e.active_ns / 1e9;
+    double throughput = seconds > 0 ? st.elements / seconds : 0;
+    double mean = st.samples ? (double)st.occupancy_sum / st.samples : 0;
+    js << sep << "    {\"name\": ";
+    print_json_string(js, name);
+    js << ", \"from\": ";
+    print_json_array(js, writers);
+    js << ", \"to\": ";
+    print_json_array(js, readers);
+    js << ", \"elements\": " << st.elements
+       << ", \"throughput\": " << throughput
+       << ", \"mean_occupancy\": " << mean
+       << ", \"max_size\": " << st.max_size
+       << ", \"producer_blocked_ns\": " << st.producer_blocked_ns
+       << ", \"consumer_blocked_ns\": " << st.consumer_blocked_ns << "}";
+    sep = ",\n";
+
+    std::ostringstream label;
+    label.setf(std::ios::fixed);
+    label.precision(1);
+    label << name << "\n" << st.elements << " elements, "
+          << throughput / 1e6 << " M/s\noccupancy " << mean
+          << " mean, " << st.max_size << " max";
+    for (int w : writers)
+      for (int r : readers) {
+        dot << "  " << dot_node(w) << " -> " << dot_node(r) << " [label=";
+        print_dot_string(dot, label.str());
+        dot << "];\n";
+      }
+  }
+  js << "\n  ]\n}\n";
+  dot << "}\n";
+}
+
+#ifndef HLS_STREAM_CHUNK_BYTES
+#define HLS_STREAM_CHUNK_BYTES 4096
 #endif
-  }
 
-  static void incr_blocked_counter() {
-    get_blocked_counter()++;
+/// Free list of the queue chunks of one size. Each thread keeps a cache
+/// in front of the shared list, so a pipeline in steady state neither
+/// locks nor calls malloc. Chunks are never returned to the heap.
+/// Chunks meant for a NUMA node have their own lists, see acquire().
+template<size_t BYTES, size_t ALIGN>
+class stream_chunk_pool {
+public:
+  /// Chunks are linked through their last pointer-sized word
+  static char *&link(char *c) {
+    return *reinterpret_cast<char **>(c + BYTES - sizeof(char *));
   }
 
-  static void decr_blocked_counter() {
-    get_blocked_counter()--;
+  /// A chunk for a channel read on NUMA node 'node', or -1 for any node
+  static char *acquire(int node) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    if (node >= 0 && sim_topology::node_count() > 1)
+      return acquire_on(node);
+#else
+    (void)node;
+#endif
+    cache &tc = get_cache();
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    if (!tc.head) {
+      shared &sh = get_shared();
+      std::lock_guard<std::mutex> lg(sh.mutex);
+      while (sh.head && (!tc.head || tc.count < tc.limit / 2)) {
+        char *c = sh.head;
+        sh.head = link(c);
+        link(c) = tc.head;
+        tc.head = c;
+        tc.count++;
+      }
+    }
+#endif
+    if (tc.head) {
+      char *c = tc.head;
+      tc.head = link(c);
+      tc.count--;
+      stream_globals::get_chunk_reuses().fetch_add(1, std::memory_order_relaxed);
+      return c;
+    }
+    stream_globals::get_chunk_allocs().fetch_add(1, std::memory_order_relaxed);
+    return allocate(BYTES, ALIGN);
   }
 
-  static void incr_task_counter() {
-    get_task_counter()++;
+  static void release(char *c, int node) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    if (node >= 0 && sim_topology::node_count() > 1) {
+      shared &sh = get_node_list(node);
+      std::lock_guard<std::mutex> lg(sh.mutex);
+      link(c) = sh.head;
+      sh.head = c;
+      return;
+    }
+#else
+    (void)node;
+#endif
+    cache &tc = get_cache();
+    link(c) = tc.head;
+    tc.head = c;
+    tc.count++;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    // Hand half of the cache over to the other threads
+    if (tc.count >= tc.limit)
+      flush(tc, tc.limit / 2);
+#endif
   }
 
-  static void decr_task_counter() {
-    get_task_counter()--;
-  }
+private:
+  static const unsigned CACHE_SIZE = 16;
 
-  static void start_threads() {
-    // These initializations must be in ONE static function that is called elsewhere
-#if defined(__HLS_COSIM__) 
-    static std::thread t(deadlock_thread);
+  /// Chunks are never freed, so before C++17 an over-allocated block
+  /// aligned by hand does not need to remember where it starts
+  static char *allocate(size_t len, size_t align) {
+#if __cpp_aligned_new
+    return static_cast<char *>(::operator new(len, std::align_val_t(align)));
+#else
+    uintptr_t p = reinterpret_cast<uintptr_t>(::operator new(len + align - 1));
+    return reinterpret_cast<char *>((p + align - 1) / align * align);
 #endif
-    static std::atomic_flag init_done = ATOMIC_FLAG_INIT;
-    if (!init_done.test_and_set()) {
-      // Perform global initialization actions once
-      // Register function executed at exit
-      std::atexit(print_max_size);
+  }
 
-#if defined(__HLS_COSIM__) 
-      // Detach the thread to avoid error at end with unwaited thread
-      t.detach();
+  // Trivially destructible, so that channels destroyed after the thread
+  // local destructors ran can still release their chunks
+  struct cache {
+    char *head;
+    unsigned count;
+    unsigned limit;
+  };
+
+#ifdef HLS_TASK_POOL_SIM
+  // Fibers migrate between workers, see task_pool::current()
+  __attribute__((noinline))
+#endif
+  static cache &get_cache() {
+    static thread_local cache c = { 0, 0, CACHE_SIZE };
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    static thread_local closer cl;
+    (void)cl;
 #endif
+    return c;
+  }
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  struct shared {
+    std::mutex mutex;
+    char *head = 0;
+  };
+
+  /// Return the cache of an exiting thread, such as a task of a joined
+  /// task_group, and bypass it from then on
+  struct closer {
+    ~closer() {
+      cache &tc = get_cache();
+      tc.limit = 0;
+      flush(tc, 0);
+    }
+  };
+
+  static void flush(cache &tc, unsigned keep) {
+    shared &sh = get_shared();
+    std::lock_guard<std::mutex> lg(sh.mutex);
+    while (tc.count > keep) {
+      char *m = tc.head;
+      tc.head = link(m);
+      tc.count--;
+      link(m) = sh.head;
+      sh.head = m;
     }
   }
 
-  static std::atomic<int> &get_max_size() {
-    static std::atomic<int> max_size(0);
+  static shared &get_shared() {
+      static shared *sh = new shared();
 
-    return max_size;
+      return *sh;
   }
 
-private:
-  static bool check_deadlock() {
-  // Check that it is larger than, because the testbench main thread is not counted.
-    return get_blocked_counter() > get_task_counter();
+  static shared &get_node_list(int node) {
+    static std::vector<shared> *lists =
+        new std::vector<shared>(sim_topology::node_count());
+    return (*lists)[node % lists->size()];
   }
 
-#ifndef HLS_STREAM_THREAD_UNSAFE
-  static std::mutex &get_mutex() {
-      static std::mutex mutex;
-
-      return mutex;
+  /// Chunks of a node bypass the thread caches, which mix the nodes.
+  /// New ones are page aligned and bound to the node before first touch.
+  static char *acquire_on(int node) {
+    shared &sh = get_node_list(node);
+    {
+      std::lock_guard<std::mutex> lg(sh.mutex);
+      if (char *c = sh.head) {
+        sh.head = link(c);
+        stream_globals::get_chunk_reuses().fetch_add(1, std::memory_order_relaxed);
+        return c;
+      }
+    }
+    const size_t PAGE = 4096;
+    size_t len = (BYTES + PAGE - 1) / PAGE * PAGE;
+    char *c = allocate(len, ALIGN > PAGE ? ALIGN : PAGE);
+    sim_topology::bind(c, len, node);
+    stream_globals::get_chunk_allocs().fetch_add(1, std::memory_order_relaxed);
+    return c;
   }
 #endif
+};
 
-  static void deadlock_thread() {
-    while (1) {
-      std::this_thread::sleep_for(std::chrono::seconds(1));
-      if (stream_globals::check_deadlock()) {
-        if (get_task_counter()) {
-            std::cout << "ERROR [HLS SIM]: deadlock detected when simulating hls::tasks." 
-                    << std::endl;
-            std::cout << "Execute C simulation in debug mode in the GUI and examine the"
-                    << " source code location of all the blocked hls::stream::read()"
-                    << " calls to debug." << std::endl;
-        } else {
-            std::cout << "ERROR [HLS SIM]: an hls::stream is read while empty,"
-                    << " which may result in RTL simulation hanging." << std::endl;
-            std::cout << "If this is not expected, execute C simulation in debug mode in"
-                    << " the GUI and examine the source code location of the blocked"
-                    << " hls::stream::read() call to debug." << std::endl;
-            std::cout << "If this is expected, add -DALLOW_EMPTY_HLS_STREAM_READS"
-                    << " to -cflags to turn this error into a warning and allow empty"
-                    << " hls::stream reads to return the default value for the data type."
-                    << std::endl;
-        }
-        abort();
-      }
-    }
+/// FIFO of c-sim channels, a drop-in for the std::deque subset they use.
+/// Elements live in fixed-size chunks from a stream_chunk_pool; the queue
+/// also keeps one spare chunk, so a channel whose occupancy oscillates
+/// around a chunk boundary does not even touch the pool.
+template<typename T>
+class stream_queue {
+  static const size_t N = sizeof(T) < HLS_STREAM_CHUNK_BYTES ?
+                          HLS_STREAM_CHUNK_BYTES / sizeof(T) : 1;
+  static const size_t LINK = (N * sizeof(T) + sizeof(char *) - 1) /
+                             sizeof(char *) * sizeof(char *);
+  static const size_t ALIGN = alignof(T) > alignof(char *) ?
+                              alignof(T) : alignof(char *);
+  typedef stream_chunk_pool<LINK + sizeof(char *), ALIGN> pool_t;
+
+public:
+  stream_queue() : head_chunk(0), tail_chunk(0), spare(0),
+                   head(0), tail(0), count(0), node(-1) {}
+
+  ~stream_queue() {
+    while (count)
+      pop_front();
+    if (head_chunk)
+      pool_t::release(head_chunk, node);
+    if (spare)
+      pool_t::release(spare, node);
   }
 
-  static std::atomic<int> &get_task_counter() {
-      static std::atomic<int> task_counter(0);
+  /// Place the chunks allocated from now on near the consumer, which
+  /// runs on NUMA node n
+  void set_node(int n) { node = n; }
+
+  size_t size() const { return count; }
+  bool empty() const { return !count; }
+
+  T &front() { return at(head_chunk, head); }
+  T &back() { return at(tail_chunk, tail - 1); }
+
+  void push_back(const T &elem) { new (slot()) T(elem); }
+  T &emplace_back() { return *new (slot()) T(); }
+
+  void pop_front() {
+    front().~T();
+    count--;
+    if (!count) {
+      // Empty: the head and tail share a chunk, restart at its beginning
+      head = tail = 0;
+    } else if (++head == N) {
+      char *c = head_chunk;
+      head_chunk = pool_t::link(c);
+      head = 0;
+      recycle(c);
+    }
+  }
 
-      return task_counter;
+private:
+  stream_queue(const stream_queue &);
+  stream_queue &operator=(const stream_queue &);
+
+  static T &at(char *c, size_t i) { return reinterpret_cast<T *>(c)[i]; }
+
+  void *slot() {
+    if (!tail_chunk) {
+      head_chunk = tail_chunk = fresh();
+    } else if (tail == N) {
+      char *c = fresh();
+      pool_t::link(tail_chunk) = c;
+      tail_chunk = c;
+      tail = 0;
+    }
+    count++;
+    return &at(tail_chunk, tail++);
   }
 
-  static std::atomic<int> &get_blocked_counter() {
-      static std::atomic<int> blocked_counter(0);
+  char *fresh() {
+    char *c = spare;
+    if (c)
+      spare = 0;
+    else
+      c = pool_t::acquire(node);
+    return c;
+  }
 
-      return blocked_counter;
+  void recycle(char *c) {
+    if (!spare)
+      spare = c;
+    else
+      pool_t::release(c, node);
   }
+
+  char *head_chunk;
+  char *tail_chunk;
+  char *spare;
+  size_t head;
+  size_t tail;
+  size_t count;
+  int node;
 };
 
-template<size_t SIZE>
-class stream_entity {
+/// Storage of one element, aligned for the element type so that the
+/// zero-copy accessors can hand out references into the queue
+template<size_t SIZE, size_t ALIGN>
+struct alignas(ALIGN) stream_slot {
+  char data[SIZE];
+};
+
+template<size_t SIZE, size_t ALIGN = 1>
+class stream_entity : public stream_base {
 public:
-#ifdef HLS_STREAM_THREAD_UNSAFE
-  stream_entity() : d(0) {}
-#else
-  stream_entity() : d(0), invalid(false) {}
+  typedef stream_slot<SIZE, ALIGN> slot_t;
+
+  stream_entity() : d(0), read_locked(false), read_scratch(false),
+                    write_locked(false), scratch(0)
+#ifndef _MSC_VER
+                    , trace(0), trace_opened(false), replay_src(0)
+#endif
+                    {}
   ~stream_entity() {
-    std::unique_lock<std::mutex> ul(mutex);
-    invalid = true;
-    condition_var.notify_all();
-  }
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    {
+      std::unique_lock<std::mutex> ul(mutex);
+      invalid = true;
+      notify_all_readers();
+    }
 #endif
+    delete[] scratch;
+#ifndef _MSC_VER
+    delete replay_src;
+#endif
+  }
 
   bool read(void *elem) {
     if (d)
@@ -178,34 +2710,14 @@ public:
 
 #ifndef HLS_STREAM_THREAD_UNSAFE
     std::unique_lock<std::mutex> ul(mutex);
-#endif
-    // needed to start the deadlock detector and size reporter
-    stream_globals::start_threads();
-
-    if (data.empty()) { 
-#ifdef ALLOW_EMPTY_HLS_STREAM_READS
-      std::cout << "WARNING [HLS SIM]: hls::stream '"
-                << name
-                << "' is read while empty,"
-                << " which may result in RTL simulation hanging."
-                << std::endl;
+    if (!wait_head(ul))
       return false;
 #else
-        stream_globals::incr_blocked_counter();
-        while (data.empty()) {
-#ifndef HLS_STREAM_THREAD_UNSAFE
-          while (invalid) { 
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-          }
-          condition_var.wait(ul);
-#endif
-        }
-        stream_globals::decr_blocked_counter();
+    if (!wait_head())
+      return false;
 #endif
-    }
-    std::array<char, SIZE> &elem_data = data.front();
-    memcpy(elem, elem_data.data(), SIZE);
-    data.pop_front();
+    memcpy(elem, data.front().data, SIZE);
+    pop_head();
     return true;
   }
 
@@ -215,22 +2727,17 @@ public:
       return;
     }
 
-    std::array<char, SIZE> elem_data;
-    memcpy(elem_data.data(), elem, SIZE);
-
-#ifndef HLS_STREAM_THREAD_UNSAFE
-    std::unique_lock<std::mutex> ul(mutex);
-#endif
-    data.push_back(elem_data);
-    
-    // needed to start the deadlock detector and size reporter
-    stream_globals::start_threads();
-    
-    if (stream_globals::get_max_size() < data.size()) 
-        stream_globals::get_max_size() = data.size();
 #ifndef HLS_STREAM_THREAD_UNSAFE
-    condition_var.notify_one();
+    std::unique_lock<std::mutex> ul(mutex, std::try_to_lock);
+    lock_for_write(ul);
 #endif
+    if (write_locked) {
+        std::cerr << "ERROR: writing " << get_name() << " while it is acquired for writing." << std::endl;
+        abort();
+    }
+    data.emplace_back();
+    memcpy(data.back().data, elem, SIZE);
+    push_tail();
   }
 
   /// Nonblocking read
@@ -238,18 +2745,113 @@ public:
     if (d)
       return d->read_nb(elem);
 
+    bool is_empty;
+    {
 #ifndef HLS_STREAM_THREAD_UNSAFE
-    std::lock_guard<std::mutex> lg(mutex);
+      std::lock_guard<std::mutex> lg(mutex);
 #endif
-    bool is_empty = data.empty();
-    if (!is_empty) {
-      std::array<char, SIZE> &elem_data = data.front();
-      memcpy(elem, elem_data.data(), SIZE);
-      data.pop_front();
+#ifndef _MSC_VER
+      if (replay_src && !readable())
+        refill();
+#endif
+      is_empty = read_locked || !readable();
+      if (!is_empty) {
+        memcpy(elem, data.front().data, SIZE);
+        pop_head();
+      }
     }
+#ifdef HLS_TASK_COROUTINE_SIM
+    // Let a testbench polling with read_nb() make progress
+    if (is_empty)
+      coroutine_scheduler::yield();
+#endif
+#ifdef HLS_TASK_POOL_SIM
+    // A task polling with read_nb() must not starve the fibers queued
+    // on its worker
+    if (is_empty && task_pool::current())
+      task_pool::yield();
+#endif
     return !is_empty; 
   }
 
+  /// Zero-copy blocking read: the head element stays in the queue until
+  /// read_release(). The returned pointer is stable while others write.
+  void *read_acquire() {
+    if (read_locked) {
+        std::cerr << "ERROR: acquiring " << get_name() << " for reading more than once before releasing." << std::endl;
+        abort();
+    }
+    if (d) {
+      // n-port channel ports only offer copies
+      read_locked = read_scratch = true;
+      if (!d->read(get_scratch(0)))
+        memset(get_scratch(0), 0, SIZE);
+      return get_scratch(0);
+    }
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::unique_lock<std::mutex> ul(mutex);
+    read_scratch = !wait_head(ul);
+#else
+    read_scratch = !wait_head();
+#endif
+    read_locked = true;
+    if (read_scratch) {
+      memset(get_scratch(0), 0, SIZE);
+      return get_scratch(0);
+    }
+    return data.front().data;
+  }
+
+  void read_release() {
+    if (!read_locked) {
+        std::cerr << "INTERNAL ERROR: releasing " << get_name() << " for reading too many times." << std::endl;
+        abort();
+    }
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    read_locked = false;
+    if (!read_scratch)
+      pop_head();
+  }
+
+  /// Zero-copy write: a slot is reserved at the tail of the queue and only
+  /// becomes visible to the reader on write_release()
+  void *write_acquire() {
+    if (write_locked) {
+        std::cerr << "ERROR: acquiring " << get_name() << " for writing more than once before releasing." << std::endl;
+        abort();
+    }
+    write_locked = true;
+    if (d)
+      return get_scratch(1);
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::unique_lock<std::mutex> ul(mutex, std::try_to_lock);
+    lock_for_write(ul);
+#endif
+    data.emplace_back();
+    return data.back().data;
+  }
+
+  void write_release() {
+    if (!write_locked) {
+        std::cerr << "INTERNAL ERROR: releasing " << get_name() << " for writing too many times." << std::endl;
+        abort();
+    }
+    if (d) {
+      write_locked = false;
+      d->write(get_scratch(1));
+      return;
+    }
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    write_locked = false;
+    push_tail();
+  }
+
   /// Fifo size
   size_t size() {
     if (d)
@@ -258,28 +2860,165 @@ public:
 #ifndef HLS_STREAM_THREAD_UNSAFE
     std::lock_guard<std::mutex> lg(mutex);
 #endif
-    return data.size();
+    return readable();
   }
 
-  /// Set name for c-sim debugging.
-  void set_name(const char *n) {
+#ifndef _MSC_VER
+  /// Append every element written from now on to the trace 'file'
+  void record(const char *file, bool timestamps) {
 #ifndef HLS_STREAM_THREAD_UNSAFE
     std::lock_guard<std::mutex> lg(mutex);
 #endif
-    name = n;
+    trace = stream_globals::open_trace(file, SIZE, timestamps);
+    trace_opened = true;
   }
 
+  /// Feed the stream from the trace 'file' whenever it runs empty
+  void replay(const char *file) {
+    stream_replay *r = new stream_replay(file, SIZE);
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    delete replay_src;
+    replay_src = r;
+  }
+#endif
+
   stream_delegate<SIZE> *d;
-  std::string name;
-  std::deque<std::array<char, SIZE> > data;
+  stream_queue<slot_t> data;
+
+private:
+  /// Elements visible to readers: a slot acquired for writing stays hidden
+  size_t readable() const {
+    return data.size() - write_locked;
+  }
+
+  /// Wait until the head element can be read, with the lock held.
+  /// Returns false if the stream is empty and empty reads are allowed.
 #ifndef HLS_STREAM_THREAD_UNSAFE
-  std::mutex mutex;
-  std::condition_variable condition_var;
-  bool invalid;
+  bool wait_head(std::unique_lock<std::mutex> &ul) {
+#else
+  bool wait_head() {
+#endif
+    // needed to start the size reporter
+    stream_globals::start_threads();
+
+    if (read_locked) {
+        std::cerr << "ERROR: reading " << get_name() << " while it is acquired for reading." << std::endl;
+        abort();
+    }
+#ifndef _MSC_VER
+    if (replay_src && !readable())
+      refill();
+#endif
+    if (!readable()) { 
+#ifdef ALLOW_EMPTY_HLS_STREAM_READS
+      std::cout << "WARNING [HLS SIM]: hls::stream '"
+                << get_name()
+                << "' is read while empty,"
+                << " which may result in RTL simulation hanging."
+                << std::endl;
+      return false;
+#else
+        auto start = std::chrono::steady_clock::now();
+#ifndef HLS_STREAM_THREAD_UNSAFE
+        wait_readable(ul, [this] { return readable() != 0; });
+        data.set_node(reader_node);
+#else
+        wait_readable([this] { return readable() != 0; });
+#endif
+        consumer_blocked(stream_stats::elapsed_ns(start));
+#endif
+    }
+    return true;
+  }
+
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  void lock_for_write(std::unique_lock<std::mutex> &ul) {
+    // The model is unbounded, so the producer only stalls on the lock
+    if (!ul.owns_lock()) {
+      auto start = std::chrono::steady_clock::now();
+      ul.lock();
+      producer_blocked(stream_stats::elapsed_ns(start));
+    }
+  }
+#endif
+
+  void pop_head() {
+    data.pop_front();
+    stats.sample(readable());
+    consumed(readable());
+  }
+
+  /// Publish the tail element, with the lock held
+  void push_tail() {
+    // needed to start the size reporter
+    stream_globals::start_threads();
+    
+    stats.elements++;
+    stats.sample(readable());
+    wrote(readable());
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    notify_reader();
+#endif
+#ifndef _MSC_VER
+    if (trace || (!trace_opened && stream_globals::get_record_dir()))
+      record_tail();
+#endif
+  }
+
+#ifndef _MSC_VER
+  void record_tail() {
+    if (!trace_opened) {
+      // Opened on the first write, when the name is final
+      std::string path = stream_globals::get_record_dir();
+      path += '/';
+      std::string n = get_name();
+      for (size_t i = 0; i < n.size(); i++) {
+        char c = n[i];
+        path += isalnum((unsigned char)c) || c == '-' || c == '.' ? c : '_';
+      }
+      path += ".hlstrace";
+      trace = stream_globals::open_trace(path, SIZE, false);
+      trace_opened = true;
+      if (!trace)
+        return;
+    }
+    trace->append(data.back().data);
+  }
+
+  /// Move the next recorded element into the empty queue, with the lock held
+  void refill() {
+    slot_t elem;
+    if (!replay_src->next(elem.data))
+      return;
+    data.push_back(elem);
+    stats.elements++;
+    stats.sample(readable());
+    update_blocked(readable());
+  }
+#endif
+
+  /// Copy buffers of delegated streams and empty reads: 0 for reads,
+  /// 1 for writes
+  char *get_scratch(int i) {
+    if (!scratch)
+      scratch = new slot_t[2];
+    return scratch[i].data;
+  }
+
+  bool read_locked;
+  bool read_scratch;
+  bool write_locked;
+  slot_t *scratch;
+#ifndef _MSC_VER
+  stream_trace *trace;
+  bool trace_opened;
+  stream_replay *replay_src;
 #endif
 };
 
-template<size_t SIZE>
+template<size_t SIZE, size_t ALIGN = 1>
 class stream_map {
 public:
   static size_t count(void *p) {
@@ -298,7 +3037,7 @@ public:
     map[p];
   }
 
-  static stream_entity<SIZE> &get_entity(void *p) {
+  static stream_entity<SIZE, ALIGN> &get_entity(void *p) {
 #ifndef HLS_STREAM_THREAD_UNSAFE
     std::lock_guard<std::mutex> lg(get_mutex());
 #endif
@@ -312,9 +3051,9 @@ private:
     return *mutex;
   }
 #endif
-  static std::unordered_map<void*, stream_entity<SIZE> > &get_map() {
-    static std::unordered_map<void*, stream_entity<SIZE> > *map = 
-        new std::unordered_map<void*, stream_entity<SIZE> >();
+  static std::unordered_map<void*, stream_entity<SIZE, ALIGN> > &get_map() {
+    static std::unordered_map<void*, stream_entity<SIZE, ALIGN> > *map = 
+        new std::unordered_map<void*, stream_entity<SIZE, ALIGN> >();
     return *map;
   }
 };
@@ -328,13 +3067,14 @@ class stream<__STREAM_T__, 0>
     using value_type = __STREAM_T__;
 
   private:
-  typedef stream_map<sizeof(__STREAM_T__)> map_t;
+  typedef stream_map<sizeof(__STREAM_T__), alignof(__STREAM_T__)> map_t;
+  typedef stream_entity<sizeof(__STREAM_T__), alignof(__STREAM_T__)> entity_t;
 
   protected:
 #if defined(__VITIS_HLS__)
     __STREAM_T__ _data;
 #else
-    stream_entity<sizeof(__STREAM_T__)> _data;
+    entity_t _data;
 #endif
 
   protected:
@@ -342,20 +3082,6 @@ class stream<__STREAM_T__, 0>
     /// Constructors
     // Keep consistent with the synthesis model's constructors
     stream() {
-      std::stringstream ss;
-#ifndef _MSC_VER
-      char* _demangle_name = abi::__cxa_demangle(typeid(*this).name(), 0, 0, 0);
-      if (_demangle_name) {
-        ss << _demangle_name;
-        free(_demangle_name);
-      }
-      else {
-        ss << "hls_stream";
-      }
-#else
-      ss << typeid(*this).name();
-#endif
-
 #ifdef HLS_STREAM_THREAD_UNSAFE
       static unsigned counter = 0;
 #else
@@ -365,8 +3091,7 @@ class stream<__STREAM_T__, 0>
 #if defined(__VITIS_HLS__)
       map_t::insert(&_data);
 #endif
-      ss << counter++;
-      get_entity().set_name(ss.str().c_str());
+      get_entity().init_name(typeid(*this), counter++);
     }
 
     stream(const char *name) {
@@ -375,7 +3100,7 @@ class stream<__STREAM_T__, 0>
 #if defined(__VITIS_HLS__)
       map_t::insert(&_data);
 #endif
-      get_entity().set_name(name);
+      get_entity().init_name(name);
     }
 
   /// Make copy constructor and assignment operator private
@@ -389,7 +3114,7 @@ class stream<__STREAM_T__, 0>
         return *this;
     }
 
-    stream_entity<sizeof(__STREAM_T__)> &get_entity() {
+    entity_t &get_entity() {
 #if defined(__VITIS_HLS__)
       return map_t::get_entity(&_data);
 #else
@@ -415,7 +3140,7 @@ class stream<__STREAM_T__, 0>
       if (!empty())
       {
           std::cout << "WARNING [HLS SIM]: hls::stream '" 
-                    << get_entity().name
+                    << get_entity().get_name()
                     << "' contains leftover data,"
                     << " which may result in RTL simulation hanging."
                     << std::endl;
@@ -437,7 +3162,8 @@ class stream<__STREAM_T__, 0>
 
     /// Blocking read
     void read(__STREAM_T__& head) {
-        head = read();
+      if (!get_entity().read(&head))
+        head = __STREAM_T__();
     }
 
     /// Blocking read
@@ -467,12 +3193,7 @@ class stream<__STREAM_T__, 0>
 
     /// Nonblocking read
     bool read_nb(__STREAM_T__& head) {
-      __STREAM_T__ elem;
-      auto &entity = get_entity();
-      bool not_empty = entity.read_nb(&elem);
-      if (not_empty)
-        head = elem;
-      return not_empty;
+      return get_entity().read_nb(&head);
     }
 
     /// Nonblocking write
@@ -482,6 +3203,26 @@ class stream<__STREAM_T__, 0>
         return !is_full;
     }
 
+    /// Zero-copy blocking read: reference to the head element, which
+    /// stays in the fifo until read_release() (see stream_read_lock)
+    __STREAM_T__ &read_acquire() {
+      return *reinterpret_cast<__STREAM_T__ *>(get_entity().read_acquire());
+    }
+
+    void read_release() {
+      get_entity().read_release();
+    }
+
+    /// Zero-copy write: reference to a slot at the tail of the fifo, which
+    /// the reader only sees after write_release() (see stream_write_lock)
+    __STREAM_T__ &write_acquire() {
+      return *reinterpret_cast<__STREAM_T__ *>(get_entity().write_acquire());
+    }
+
+    void write_release() {
+      get_entity().write_release();
+    }
+
     /// Fifo size
     size_t size() {
       return get_entity().size();
@@ -498,9 +3239,46 @@ class stream<__STREAM_T__, 0>
       get_entity().set_name(name);
     }
 
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    /// Set the spin budget of blocking reads before parking, 0 to park
+    /// immediately (see HLS_STREAM_SPIN_COUNT for the process default).
+    void set_spin_count(unsigned n) {
+      get_entity().set_spin_count(n);
+    }
+#endif
+
+#ifndef _MSC_VER
+    /// Record every element written to this stream from now on in the
+    /// binary trace 'file', optionally with timestamps. Setting the
+    /// HLS_STREAM_RECORD_DIR environment variable records all streams,
+    /// one file per stream name.
+    void record(const char *file, bool timestamps = false) {
+      get_entity().record(file, timestamps);
+    }
+
+    /// Feed this stream from a trace written by record(), so that the
+    /// task reading it can be simulated in isolation
+    void replay(const char *file) {
+      get_entity().replay(file);
+    }
+#endif
+
     void set_delegate(stream_delegate<sizeof(__STREAM_T__)> *d) {
       get_entity().d = d;
     }
+
+    /// Channel carrying the data: the n-port channel this port delegates
+    /// to, if it keeps its own queue, or the stream itself
+    stream_base &channel() {
+      entity_t &e = get_entity();
+      if (e.d) {
+        if (stream_base *b = e.d->channel())
+          return *b;
+        if (stream_base *b = dynamic_cast<stream_base *>(e.d))
+          return *b;
+      }
+      return e;
+    }
 };
 
 template<typename __STREAM_T__, int DEPTH>
@@ -510,6 +3288,40 @@ public:
   stream(const char* name) : stream<__STREAM_T__, 0>(name) {}
 };
 
+/// Scoped zero-copy access to the head of an hls::stream, with the
+/// semantics of read_lock on hls::stream_of_blocks
+template<typename __STREAM_T__>
+class stream_read_lock {
+  stream<__STREAM_T__> &res;
+  __STREAM_T__ &buf;
+
+public:
+  stream_read_lock(stream<__STREAM_T__> &s) : res(s), buf(s.read_acquire()) {}
+
+  ~stream_read_lock() { res.read_release(); }
+
+  operator __STREAM_T__&() { return buf; }
+
+  __STREAM_T__& operator=(const __STREAM_T__& val) { return buf = val; }
+};
+
+/// Scoped zero-copy access to a new tail element of an hls::stream, with
+/// the semantics of write_lock on hls::stream_of_blocks
+template<typename __STREAM_T__>
+class stream_write_lock {
+  stream<__STREAM_T__> &res;
+  __STREAM_T__ &buf;
+
+public:
+  stream_write_lock(stream<__STREAM_T__> &s) : res(s), buf(s.write_acquire()) {}
+
+  ~stream_write_lock() { res.write_release(); }
+
+  operator __STREAM_T__&() { return buf; }
+
+  __STREAM_T__& operator=(const __STREAM_T__& val) { return buf = val; }
+};
+
 } // namespace hls
 
 #endif // __cplusplus
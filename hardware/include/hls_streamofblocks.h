@@ -18,6 +18,9 @@
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include <unordered_map>
+#include <vector>
+#include <memory>
 #include "hls_stream.h"
 
 #define ALWAYS_INLINE inline 
@@ -34,113 +37,309 @@
 #endif
 
 namespace hls {
+/// The blocks of a broadcast_stream_of_blocks, shared by its writer end
+/// and its reader ports: a port may release a block after the writer end
+/// is destroyed. A block goes back to the free list once all the ports
+/// released it.
 template <typename __STREAM_T__>
-class stream_buf {
-  std::string name;
-  std::deque<__STREAM_T__*> data;
+class broadcast_blocks {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  std::mutex mutex;
+#endif
+  // Number of ports still holding each block in flight
+  std::unordered_map<__STREAM_T__*, unsigned> refs;
+  stream_queue<__STREAM_T__*> free_blocks;
+
+ public:
+  ~broadcast_blocks() {
+    for (auto &ref : refs)
+      delete[] ref.first;
+    for (; !free_blocks.empty(); free_blocks.pop_front())
+      delete[] free_blocks.front();
+  }
+
+  __STREAM_T__ *acquire() {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    if (free_blocks.empty())
+      return new __STREAM_T__[1];
+    // Like a ping-pong buffer, a recycled block keeps its old contents
+    __STREAM_T__ *block = free_blocks.front();
+    free_blocks.pop_front();
+    return block;
+  }
+
+  /// 'block' is queued in 'n' ports
+  void hold(__STREAM_T__ *block, unsigned n) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    refs[block] = n;
+  }
+
+  /// A port is done with 'block'
+  void release(__STREAM_T__ *block) {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::lock_guard<std::mutex> lg(mutex);
+#endif
+    auto it = refs.find(block);
+    if (--it->second)
+      return;
+    refs.erase(it);
+    free_blocks.push_back(block);
+  }
+};
+
+template <typename __STREAM_T__>
+class stream_buf : public stream_base {
+  stream_queue<__STREAM_T__*> data;
   int readLocks;
   int writeLocks;
+  // Block being written, only visible to the reader once released
+  __STREAM_T__ *writing;
+  // Blocks released by the reader, handed out again by write_acquire(),
+  // so the channel allocates at most DEPTH + 1 blocks while tasks run
+  stream_queue<__STREAM_T__*> free_blocks;
+  // Returned by reads of an empty channel (ALLOW_EMPTY_HLS_STREAM_READS)
+  __STREAM_T__ *empty_block;
+  bool read_empty;
+  // Broadcast (see broadcast_stream_of_blocks): the writer end hands each
+  // block to every reader port it owns, without copying
+  std::vector<std::shared_ptr<stream_buf> > ports;
+  std::shared_ptr<broadcast_blocks<__STREAM_T__> > blocks;
  
  public:
   ALWAYS_INLINE stream_buf(int depth, const char *n)
-    : name(n ? n : "stream_of_blocks"), readLocks(0), 
-      writeLocks(0), invalid(false){}
+    : readLocks(0), writeLocks(0), writing(0), empty_block(0), read_empty(false) {
+    init_name(n ? n : "stream_of_blocks");
+    capacity = depth > 0 ? depth : 1;
+  }
 
+  /// The stream_of_blocks and the locks on it share the channel: it is
+  /// only destroyed once all of them are gone, so no block is held.
   ~stream_buf() {
+    // The blocks queued in a broadcast port are freed with the others
+    // of the broadcast
+    for (; !data.empty(); data.pop_front())
+      if (!blocks)
+        delete[] data.front();
+    for (; !free_blocks.empty(); free_blocks.pop_front())
+      delete[] free_blocks.front();
+    delete[] writing;
+    delete[] empty_block;
+  }
+
+  /// The stream_of_blocks is destroyed: wake up the tasks waiting on it,
+  /// which never run again. The locks still held release their blocks.
+  void close() {
 #ifndef HLS_STREAM_THREAD_UNSAFE
     std::unique_lock<std::mutex> ul(mutex);
     invalid = true;
-    condition_var.notify_all();
+    notify_all_readers();
 #endif
   }
 
   void write_check() {
     if (writeLocks <= 0) {
-        std::cerr << "ERROR: writing " << name << " before acquiring." << std::endl;
+        std::cerr << "ERROR: writing " << get_name() << " before acquiring." << std::endl;
         abort();
     }
   }
   void read_check() {
     if (readLocks <= 0) {
-        std::cerr << "ERROR: reading " << name << " before acquiring." << std::endl;
+        std::cerr << "ERROR: reading " << get_name() << " before acquiring." << std::endl;
         abort();
     }
   }
 
+  /// The blocks in flight include the one held by the reader. Without
+  /// hls::tasks, the dataflow processes run one after the other, so the
+  /// producer must run ahead: the channel is then unbounded.
+#ifndef HLS_STREAM_THREAD_UNSAFE
+  void wait_room(std::unique_lock<std::mutex> &ul) {
+#else
+  void wait_room() {
+#endif
+    if (data.size() < capacity)
+      return;
+    stats.full_writes++;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    if (stream_globals::tasks_running()) {
+      auto start = std::chrono::steady_clock::now();
+      wait_writable(ul, [this] { return data.size() < capacity; });
+      producer_blocked(stream_stats::elapsed_ns(start));
+    }
+#endif
+  }
+
   ALWAYS_INLINE __STREAM_T__& read_acquire() {
-    // needed to start the deadlock detector and size reporter
+    // needed to start the size reporter
     stream_globals::start_threads();
 
     if (readLocks > 0) {
-        std::cerr << "ERROR: acquiring " << name << " for reading more than once before releasing. Use braces to limit the lifetime of the lock object." << std::endl;
+        std::cerr << "ERROR: acquiring " << get_name() << " for reading more than once before releasing. Use braces to limit the lifetime of the lock object." << std::endl;
+        abort();
+    }
+    if (!ports.empty()) {
+        std::cerr << "ERROR: reading the 'in' port of broadcast stream_of_blocks " << get_name() << "." << std::endl;
         abort();
     }
-    readLocks++;
 #ifndef HLS_STREAM_THREAD_UNSAFE
     std::unique_lock<std::mutex> ul(mutex);
 #endif
     if (!data.size()) { 
 #ifdef ALLOW_EMPTY_HLS_STREAM_READS
       std::cout << "WARNING [HLS SIM]: hls::stream_of_blocks '"
-                << name
+                << get_name()
                 << "' is read while empty,"
                 << " which may result in RTL simulation hanging."
                 << std::endl;
-        return *new __STREAM_T__[1];
+        readLocks++;
+        read_empty = true;
+        if (!empty_block)
+          empty_block = new __STREAM_T__[1];
+        return *empty_block;
 #else
-        stream_globals::incr_blocked_counter();
-        while (!data.size()) {
+        auto start = std::chrono::steady_clock::now();
 #ifndef HLS_STREAM_THREAD_UNSAFE
-          while (invalid) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-           }
-          condition_var.wait(ul);
+        wait_readable(ul, [this] { return !data.empty(); });
+        data.set_node(reader_node);
+#else
+        wait_readable([this] { return !data.empty(); });
 #endif
-        }
-        stream_globals::decr_blocked_counter();
+        consumer_blocked(stream_stats::elapsed_ns(start));
 #endif
     }
+    // Only counted once acquired: a stopped task_group ends the wait
+    readLocks++;
     return *data.front();
   }
  
   ALWAYS_INLINE void read_release() {
     readLocks--;
     if (readLocks != 0) {
-        std::cerr << "INTERNAL ERROR: releasing " << name << " for reading too many times." << std::endl;
+        std::cerr << "INTERNAL ERROR: releasing " << get_name() << " for reading too many times." << std::endl;
         abort();
     }
+    if (read_empty) {
+      read_empty = false;
+      return;
+    }
 #ifndef HLS_STREAM_THREAD_UNSAFE
     std::unique_lock<std::mutex> ul(mutex);
 #endif
+    __STREAM_T__ *block = data.front();
+    if (!blocks)
+      free_blocks.push_back(block);
     data.pop_front();
+    stats.sample(data.size());
+    consumed(data.size());
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    // A writer waiting for room
+    notify_reader();
+    ul.unlock();
+#endif
+    if (blocks)
+      blocks->release(block);
   }
  
   ALWAYS_INLINE __STREAM_T__& write_acquire() {
-    // needed to start the deadlock detector and size reporter
+    // needed to start the size reporter
     stream_globals::start_threads();
 
     if (writeLocks > 0) {
-        std::cerr << "ERROR: acquiring " << name << " for writing more than once before releasing. Use braces to limit the lifetime of the lock object." << std::endl;
+        std::cerr << "ERROR: acquiring " << get_name() << " for writing more than once before releasing. Use braces to limit the lifetime of the lock object." << std::endl;
         abort();
     }
-    writeLocks++;
-
+    // A broadcast writer waits for room in every reader port
+    for (auto &port : ports) {
 #ifndef HLS_STREAM_THREAD_UNSAFE
-    std::unique_lock<std::mutex> ul(mutex);
+      std::unique_lock<std::mutex> ul(port->mutex);
+      port->wait_room(ul);
+#else
+      port->wait_room();
 #endif
-    data.push_back(new __STREAM_T__[1]);
+    }
+    if (!ports.empty()) {
+      writing = blocks->acquire();
+      writeLocks++;
+      return *writing;
+    }
+    {
 #ifndef HLS_STREAM_THREAD_UNSAFE
-    condition_var.notify_one();
+      std::unique_lock<std::mutex> ul(mutex);
+      wait_room(ul);
+#else
+      wait_room();
 #endif
-    return *data.back();
+      if (!free_blocks.empty()) {
+        // Like a ping-pong buffer, a recycled block keeps its old contents
+        writing = free_blocks.front();
+        free_blocks.pop_front();
+      }
+      if (!writing)
+        writing = new __STREAM_T__[1];
+      writeLocks++;
+    }
+    return *writing;
   }
 
   ALWAYS_INLINE void write_release() {
     writeLocks--;
     if (writeLocks != 0) {
-        std::cerr << "INTERNAL ERROR: releasing " << name << " for writing too many times." << std::endl;
+        std::cerr << "INTERNAL ERROR: releasing " << get_name() << " for writing too many times." << std::endl;
         abort();
     }
+    if (!ports.empty()) {
+      broadcast();
+      return;
+    }
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::unique_lock<std::mutex> ul(mutex);
+#endif
+    data.push_back(writing);
+    writing = 0;
+    stats.elements++;
+    stats.sample(data.size());
+    wrote(data.size());
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    notify_reader();
+#endif
+  }
+
+  /// Queue the block just written in every reader port, without copying
+  void broadcast() {
+    blocks->hold(writing, ports.size());
+    {
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      std::unique_lock<std::mutex> ul(mutex);
+#endif
+      stats.elements++;
+      wrote(0);
+    }
+    for (auto &p : ports) {
+      stream_buf &port = *p;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      std::unique_lock<std::mutex> ul(port.mutex);
+#endif
+      port.data.push_back(writing);
+      port.stats.elements++;
+      port.stats.sample(port.data.size());
+      port.wrote(port.data.size());
+#ifndef HLS_STREAM_THREAD_UNSAFE
+      port.notify_reader();
+#endif
+    }
+    writing = 0;
+  }
+
+  /// Make this the writer end of a broadcast, also to 'port'
+  void add_port(const std::shared_ptr<stream_buf> &port) {
+    if (!blocks)
+      blocks = std::make_shared<broadcast_blocks<__STREAM_T__> >();
+    ports.push_back(port);
+    port->blocks = blocks;
   }
  
   ALWAYS_INLINE bool empty() {
@@ -150,8 +349,16 @@ class stream_buf {
     return !data.size();
   }
 
+  /// DEPTH blocks are in flight, counting the one being read. A
+  /// broadcast is full as soon as one of its reader ports is.
   ALWAYS_INLINE bool full() {
-    return false;
+    for (auto &port : ports)
+      if (port->full())
+        return true;
+#ifndef HLS_STREAM_THREAD_UNSAFE
+    std::unique_lock<std::mutex> ul(mutex);
+#endif
+    return data.size() >= capacity;
   }
 
 #ifdef EXPLICIT_ACQUIRE_RELEASE
@@ -165,11 +372,6 @@ class stream_buf {
   friend class read_lock;
   template <typename>
   friend class write_lock;
-#ifndef HLS_STREAM_THREAD_UNSAFE
-  std::mutex mutex;
-  std::condition_variable condition_var;
-  bool invalid;
-#endif
 };
  
 template<typename __STREAM_T__, int DEPTH=2>
@@ -178,30 +380,30 @@ class stream_of_blocks;
 #ifdef EXPLICIT_ACQUIRE_RELEASE
 template <typename __STREAM_T__>
 class read_buf {
-  stream_of_blocks<__STREAM_T__>& res;
+  std::shared_ptr<stream_buf<__STREAM_T__> > res;
   __STREAM_T__* buf;
  
  public:
-  ALWAYS_INLINE read_buf(stream_of_blocks<__STREAM_T__>& s) : res(s) {
+  ALWAYS_INLINE read_buf(stream_of_blocks<__STREAM_T__>& s) : res(s.buf) {
   }
 
   ALWAYS_INLINE void acquire() {
-    buf = &res.read_acquire();
+    buf = &res->read_acquire();
   }
 
   ALWAYS_INLINE void release() {
-    res.read_release();
+    res->read_release();
   }
 
   ALWAYS_INLINE ~read_buf() { }
 
   ALWAYS_INLINE operator __STREAM_T__&() { 
-    res.buf.read_check();
+    res->read_check();
     return *buf;
   }
 
   ALWAYS_INLINE __STREAM_T__& operator=(const __STREAM_T__& val) { 
-    res.buf.read_check();
+    res->read_check();
     buf = &val; 
     return *buf; 
   }
@@ -209,45 +411,47 @@ class read_buf {
  
 template <typename __STREAM_T__>
 class write_buf {
-  stream_of_blocks<__STREAM_T__>& res;
+  std::shared_ptr<stream_buf<__STREAM_T__> > res;
   __STREAM_T__* buf;
  
  public:
-  ALWAYS_INLINE write_buf(stream_of_blocks<__STREAM_T__>& s) : res(s) {
+  ALWAYS_INLINE write_buf(stream_of_blocks<__STREAM_T__>& s) : res(s.buf) {
   }
 
   ALWAYS_INLINE void acquire() {
-    buf = &res.write_acquire();
+    buf = &res->write_acquire();
   }
 
   ALWAYS_INLINE void release() {
-    res.write_release();
+    res->write_release();
   }
 
   ALWAYS_INLINE ~write_buf() { }
 
   ALWAYS_INLINE operator __STREAM_T__&() { 
-    res.buf.write_check();
+    res->write_check();
     return *buf; 
   }
 
   ALWAYS_INLINE __STREAM_T__& operator=(const __STREAM_T__& val) {
-    res.buf.write_check();
+    res->write_check();
     buf = &val; 
     return *buf; 
   }
 };
 #endif
 
+/// The locks keep the channel alive: a task may still hold a block when
+/// the stream_of_blocks is destroyed, e.g. a detached hls::task at exit.
 template <typename __STREAM_T__>
 class read_lock {
-  stream_of_blocks<__STREAM_T__>& res;
+  std::shared_ptr<stream_buf<__STREAM_T__> > res;
   __STREAM_T__& buf;
  
  public:
-  ALWAYS_INLINE read_lock(stream_of_blocks<__STREAM_T__>& s) : res(s), buf(res.read_acquire()) { }
+  ALWAYS_INLINE read_lock(stream_of_blocks<__STREAM_T__>& s) : res(s.buf), buf(res->read_acquire()) { }
 
-  ALWAYS_INLINE ~read_lock() { res.read_release(); }
+  ALWAYS_INLINE ~read_lock() { res->read_release(); }
 
   ALWAYS_INLINE operator __STREAM_T__&() { return buf; }
 
@@ -256,13 +460,13 @@ class read_lock {
  
 template <typename __STREAM_T__>
 class write_lock {
-  stream_of_blocks<__STREAM_T__>& res;
+  std::shared_ptr<stream_buf<__STREAM_T__> > res;
   __STREAM_T__& buf;
  
  public:
-  ALWAYS_INLINE write_lock(stream_of_blocks<__STREAM_T__>& s) : res(s), buf(res.write_acquire()) { }
+  ALWAYS_INLINE write_lock(stream_of_blocks<__STREAM_T__>& s) : res(s.buf), buf(res->write_acquire()) { }
 
-  ALWAYS_INLINE ~write_lock() { res.write_release(); }
+  ALWAYS_INLINE ~write_lock() { res->write_release(); }
 
   ALWAYS_INLINE operator __STREAM_T__&() { return buf; }
 
@@ -277,24 +481,24 @@ class stream_of_blocks<__STREAM_T__, 2> {
 #endif
   friend class read_lock<__STREAM_T__>; 
   friend class write_lock<__STREAM_T__>; 
+  template <typename, unsigned, int>
+  friend class broadcast_stream_of_blocks;
 
-  stream_buf<__STREAM_T__> buf;
+  std::shared_ptr<stream_buf<__STREAM_T__> > buf;
  
  public:
-  ALWAYS_INLINE stream_of_blocks(int depth=2, UNUSED_ARG char *name=0): buf(depth, name) { }
+  ALWAYS_INLINE stream_of_blocks(int depth=2, UNUSED_ARG char *name=0)
+    : buf(std::make_shared<stream_buf<__STREAM_T__> >(depth, name)) { }
 
-  ALWAYS_INLINE bool full() { return buf.full(); }
+  stream_of_blocks(const stream_of_blocks &) = delete;
 
-  ALWAYS_INLINE bool empty() { return buf.empty(); }
+  ~stream_of_blocks() { buf->close(); }
 
- private:
-  ALWAYS_INLINE __STREAM_T__& read_acquire() { return buf.read_acquire(); }
+  ALWAYS_INLINE bool full() { return buf->full(); }
 
-  ALWAYS_INLINE void read_release() { buf.read_release(); }
- 
-  ALWAYS_INLINE __STREAM_T__& write_acquire() { return buf.write_acquire(); }
+  ALWAYS_INLINE bool empty() { return buf->empty(); }
 
-  ALWAYS_INLINE void write_release() { buf.write_release(); }
+  stream_base &channel() { return *buf; }
 
   //__STREAM_T__& read(); TBD
   //void write(const __STREAM_T__&); TBD
@@ -313,6 +517,32 @@ class stream_of_blocks: public stream_of_blocks<__STREAM_T__, 2> {
   ALWAYS_INLINE stream_of_blocks(): stream_of_blocks<__STREAM_T__, 2>(DEPTH) {}
 };
 
+/// One writer, N_READERS readers that each see every block, as when a
+/// block feeds several consumers in parallel:
+///
+///   hls::broadcast_stream_of_blocks<buf_t, 2> bc;
+///   { hls::write_lock<buf_t> w(bc.in); ... }    // producer
+///   { hls::read_lock<buf_t> r(bc.out[i]); ... } // consumer i
+///
+/// The readers share the block the producer wrote: it is recycled once
+/// all of them released it. Each reader port holds DEPTH blocks, so the
+/// slowest reader throttles the producer.
+template <typename __STREAM_T__, unsigned N_READERS, int DEPTH = 2>
+class broadcast_stream_of_blocks {
+public:
+  stream_of_blocks<__STREAM_T__, DEPTH> in;
+  stream_of_blocks<__STREAM_T__, DEPTH> out[N_READERS];
+
+  broadcast_stream_of_blocks(const char *name = "broadcast") {
+    in.buf->init_name(name);
+    for (unsigned i = 0; i < N_READERS; i++) {
+      out[i].buf->init_name((std::string(name) + "_" + std::to_string(i)).c_str());
+      in.buf->add_port(out[i].buf);
+    }
+  }
+};
+
+
 } // end of namespace hls
 #endif
 #endif
@@ -95,30 +95,117 @@ public:
 #define hls_thread_local
 
 #else 
+/// Each task runs its body forever in a detached thread, or as a
+/// coroutine on the testbench thread when HLS_TASK_COROUTINE_SIM is
+/// defined (deterministic scheduling, see coroutine_scheduler), or as a
+/// fiber on a pool of worker threads when HLS_TASK_POOL_SIM is defined
+/// (see task_pool).
 class task {
+  int id;
+#if !defined(HLS_TASK_COROUTINE_SIM) && !defined(HLS_TASK_POOL_SIM)
+  std::thread::native_handle_type handle;
+  bool started = false;
+#endif
 public:
   task() {
-    stream_globals::incr_task_counter();
+    id = stream_globals::incr_task_counter();
   }
   ~task() {
   }
   template <class T, class... Args>
   void operator()(T fn, Args&&... args) {
-    std::thread tmp(t_wrapper<T, decltype(auto_ref(args))...>, fn, auto_ref(args)...);
-    tmp.detach();
+    start(fn, auto_ref(args)...);
   }
   template <class T, class... Args>
   task(T fn, Args&&... args) {
-    stream_globals::incr_task_counter();
-    std::thread tmp(t_wrapper<T, decltype(auto_ref(args))...>, fn, auto_ref(args)...);
-    tmp.detach();
+    id = stream_globals::incr_task_counter();
+    start(fn, auto_ref(args)...);
+  }
+
+  /// Restrict the thread of the task to the cores in 'cpus', such as
+  /// "0-3,8". The coroutine and pool engines ignore it, as their tasks do
+  /// not own a thread.
+  void set_affinity(const char *cpus) {
+#if !defined(HLS_TASK_COROUTINE_SIM) && !defined(HLS_TASK_POOL_SIM)
+    if (started)
+      sim_topology::pin(handle, sim_topology::parse_cpus(cpus));
+#else
+    (void)cpus;
+#endif
   }
 private:
+  template <class T, class... Args>
+  void start(T fn, Args... args) {
+    // The dataflow graph links the task to the channels it receives
+    int attached[] = { 0, (attach(args), 0)... };
+    (void)attached;
+    task_group_state *group = stream_globals::active_group();
+    if (group) {
+      std::lock_guard<std::mutex> lg(group->mutex);
+      group->tasks++;
+    }
+#ifdef HLS_TASK_COROUTINE_SIM
+    // Runs on the testbench thread as soon as the testbench blocks
+    coroutine_scheduler::spawn(std::bind(t_wrapper<T, Args...>, id, group, fn, args...));
+#elif defined(HLS_TASK_POOL_SIM)
+    task_pool::spawn(std::bind(t_wrapper<T, Args...>, id, group, fn, args...));
+#else
+    // The affinity of the group, or the HLS_TASK_AFFINITY policy
+    std::vector<int> cpus;
+    if (group)
+      cpus = group->cpus;
+    if (cpus.empty() && sim_topology::policy_cpu(id - 1) >= 0)
+      cpus.push_back(sim_topology::policy_cpu(id - 1));
+    std::thread tmp(t_wrapper<T, Args...>, id, group, fn, args...);
+    handle = tmp.native_handle();
+    started = true;
+    sim_topology::pin(handle, cpus);
+    if (group) {
+      std::lock_guard<std::mutex> lg(group->mutex);
+      group->threads.push_back(std::move(tmp));
+      return;
+    }
+    tmp.detach();
+#endif
+  }
+
   template <class T, class...Args>
-  static void t_wrapper(T fn, Args... args) {
-    while(1) {
-      fn(args...);
+  static void t_wrapper(int id, task_group_state *group, T fn, Args... args) {
+    // Identifies this thread in deadlock reports
+    task_context &context = stream_globals::current_context();
+    context.id = id;
+    context.group = group;
+    task_profile *profile = 0;
+    if (stream_globals::task_profiling())
+      profile = context.profile = stream_globals::new_profile(id);
+    try {
+      while(1) {
+        fn(args...);
+        if (profile)
+          profile->iterations.fetch_add(1, std::memory_order_relaxed);
+      }
+    } catch (task_stopped &) {
+      // Only the tasks of a stopped task_group get here
     }
+    if (profile)
+      profile->exited();
+    stream_globals::decr_task_counter();
+    if (group)
+      group->task_exited();
+  }
+
+  template<typename T, int DEPTH>
+  void attach(std::reference_wrapper<hls::stream<T, DEPTH>> s) {
+    s.get().channel().attach_task(id);
+  }
+
+  template<typename T, int DEPTH>
+  void attach(std::reference_wrapper<hls::stream_of_blocks<T, DEPTH>> s) {
+    s.get().channel().attach_task(id);
+  }
+
+  template<typename T>
+  void attach(const T &) {
   }
 
   template<typename T, int DEPTH>
@@ -138,6 +225,72 @@ private:
 
 };
 
+/// Tasks created on a thread while a task_group is alive belong to the
+/// group, so that a process can run and tear down many independent jobs.
+/// Declare the group after the channels of its tasks: its destructor
+/// stops the tasks and joins them, which needs the channels.
+class task_group {
+  task_group_state state;
+  task_group_state *prev;
+public:
+  task_group() : prev(stream_globals::active_group()) {
+    stream_globals::active_group() = &state;
+  }
+  ~task_group() {
+    stop();
+    join();
+    stream_globals::active_group() = prev;
+  }
+
+  /// Restrict the threads of the tasks created from now on to the cores
+  /// in 'cpus', such as "0-15" for the first socket. This takes
+  /// precedence over HLS_TASK_AFFINITY.
+  void set_affinity(const char *cpus) {
+    std::lock_guard<std::mutex> lg(state.mutex);
+    state.cpus = sim_topology::parse_cpus(cpus);
+  }
+
+  /// True when every task of the group is blocked on an empty channel
+  bool quiescent() {
+    std::lock_guard<std::mutex> lg(state.mutex);
+    return state.blocked == state.tasks;
+  }
+
+  void wait_quiescent() {
+#ifdef HLS_TASK_COROUTINE_SIM
+    // Coroutines that are not ready are blocked
+    while (!quiescent())
+      coroutine_scheduler::yield();
+#else
+    std::unique_lock<std::mutex> ul(state.mutex);
+    state.cv.wait(ul, [this] { return state.blocked == state.tasks; });
+#endif
+  }
+
+  /// Wait until the group is quiescent, then end every task at the
+  /// blocking read it is waiting in
+  void stop() {
+    wait_quiescent();
+    state.stopping = true;
+    stream_globals::wake_group(&state);
+  }
+
+  /// Wait until the tasks of the stopped group exited
+  void join() {
+#if defined(HLS_TASK_COROUTINE_SIM)
+    while (state.tasks)
+      coroutine_scheduler::yield();
+#elif defined(HLS_TASK_POOL_SIM)
+    std::unique_lock<std::mutex> ul(state.mutex);
+    state.cv.wait(ul, [this] { return !state.tasks; });
+#else
+    for (std::thread &t : state.threads)
+      t.join();
+    state.threads.clear();
+#endif
+  }
+};
+
 #define hls_thread_local thread_local
 #endif // __SYNTHESIS__
 } 
@@ -9,6 +9,7 @@
 #include <cassert>
 #include <cstddef>
 #include <initializer_list>
+#include <type_traits>
 
 namespace hls {
 
@@ -28,6 +29,15 @@ namespace hls {
 #define INLINE [[gnu::always_inline]]
 #endif
 
+// C simulation runs the elementwise operators of vectors of native
+// arithmetic types on GCC vector extensions, with the scalar loop as
+// fallback. Define HLS_VECTOR_NO_SIMD to only use the scalar loops.
+#if !defined(__SYNTHESIS__) && defined(__GNUC__) && !defined(HLS_VECTOR_NO_SIMD)
+#define HLS_VECTOR_SIMD 1
+#else
+#define HLS_VECTOR_SIMD 0
+#endif
+
 namespace details {
 
 /// Returns the greatest power of two that divides N
@@ -39,6 +49,143 @@ constexpr size_t gp2(size_t N) {
   return 2 * gp2(N / 2);
 }
 
+/// True when every index of I is below N
+template <size_t N, size_t... I>
+struct indices_below : std::true_type {};
+
+template <size_t N, size_t I, size_t... R>
+struct indices_below<N, I, R...>
+    : std::integral_constant<bool, (I < N) && indices_below<N, R...>::value> {};
+
+#if HLS_VECTOR_SIMD
+/// Lane types of the SIMD operators
+template <typename T>
+struct simd_lane
+    : std::integral_constant<bool, (std::is_integral<T>::value &&
+                                    !std::is_same<T, bool>::value &&
+                                    sizeof(T) <= 8) ||
+                                       std::is_same<T, float>::value ||
+                                       std::is_same<T, double>::value> {};
+
+/// The operators whose SIMD lanes give the results of the scalar loop.
+/// Integer lanes of the wrapping operators are unsigned, so that a lane
+/// never overflows: wrapping around gives the bits of the scalar result,
+/// including for lanes narrower than int, which the scalar operators
+/// promote. Integer division has no SIMD instruction, and shifts of
+/// lanes narrower than int differ from the scalar ones.
+#define SIMD_OP(NAME, OP, WRAP, COND)                                          \
+  struct simd_##NAME {                                                         \
+    static const bool wrap = WRAP;                                             \
+    template <typename T>                                                      \
+    struct enabled                                                             \
+        : std::integral_constant<bool, simd_lane<T>::value && (COND)> {};     \
+    template <typename V>                                                      \
+    static void apply(V &a, const V &b) { a = a OP b; }                        \
+  };
+
+SIMD_OP(add, +, true, true)
+SIMD_OP(sub, -, true, true)
+SIMD_OP(mul, *, true, true)
+SIMD_OP(div, /, false, std::is_floating_point<T>::value)
+SIMD_OP(mod, %, false, false)
+SIMD_OP(and, &, false, std::is_integral<T>::value)
+SIMD_OP(or,  |, false, std::is_integral<T>::value)
+SIMD_OP(xor, ^, false, std::is_integral<T>::value)
+SIMD_OP(shl, <<, false, std::is_integral<T>::value && sizeof(T) >= sizeof(int))
+SIMD_OP(shr, >>, false, std::is_integral<T>::value && sizeof(T) >= sizeof(int))
+
+#undef SIMD_OP
+
+#define SIMD_CMP_OP(NAME, OP)                                                  \
+  struct simd_##NAME {                                                         \
+    static const bool wrap = false;                                            \
+    template <typename T>                                                      \
+    struct enabled : simd_lane<T> {};                                          \
+    template <typename V>                                                      \
+    static void apply(V &a, const V &b) { a = b OP a ? b : a; }                \
+  };
+
+SIMD_CMP_OP(min, <)
+SIMD_CMP_OP(max, >)
+
+#undef SIMD_CMP_OP
+
+/// Lane type of OP on elements of type T
+template <typename OP, typename T,
+          bool = OP::wrap && std::is_integral<T>::value &&
+                 !std::is_same<T, bool>::value>
+struct simd_lane_type {
+  typedef T type;
+};
+
+template <typename OP, typename T>
+struct simd_lane_type<OP, T, true> {
+  typedef typename std::make_unsigned<T>::type type;
+};
+
+/// a[i] = a[i] OP b[i] on the blocks of 'BYTES' bytes from 'i', returns
+/// the first element left
+template <size_t BYTES, typename OP, typename T>
+inline size_t simd_blocks(T *a, const T *b, size_t i, size_t n) {
+  // Unaligned blocks that may alias the elements
+  typedef typename simd_lane_type<OP, T>::type lane_t;
+  typedef lane_t block_t
+      __attribute__((vector_size(BYTES), aligned(sizeof(T)), may_alias));
+  const size_t lanes = BYTES / sizeof(T);
+  for (; i + lanes <= n; i += lanes)
+    OP::apply(*reinterpret_cast<block_t *>(a + i),
+              *reinterpret_cast<const block_t *>(b + i));
+  return i;
+}
+
+/// Runs the elements of 'a' and 'b' in blocks of 64 bytes, then 16 and
+/// 8, and returns the first element left for the scalar loop
+template <typename OP, typename T, bool = OP::template enabled<T>::value>
+struct simd_inplace {
+  static size_t apply(T *, const T *, size_t) { return 0; }
+};
+
+template <typename OP, typename T>
+struct simd_inplace<OP, T, true> {
+  static size_t apply(T *a, const T *b, size_t n) {
+    size_t i = simd_blocks<64, OP>(a, b, 0, n);
+    i = simd_blocks<16, OP>(a, b, i, n);
+    return simd_blocks<8, OP>(a, b, i, n);
+  }
+};
+
+/// Folds the blocks of 16 bytes of 'a' into 'res', and returns the first
+/// element left for the scalar loop (1 if the blocks were not folded).
+/// Only integer lanes, whose result does not depend on the order.
+template <typename OP, typename T,
+          bool = OP::template enabled<T>::value && std::is_integral<T>::value>
+struct simd_reduce {
+  static size_t apply(const T *, size_t, T &) { return 1; }
+};
+
+template <typename OP, typename T>
+struct simd_reduce<OP, T, true> {
+  static size_t apply(const T *a, size_t n, T &res) {
+    typedef typename simd_lane_type<OP, T>::type lane_t;
+    typedef lane_t block_t
+        __attribute__((vector_size(16), aligned(sizeof(T)), may_alias));
+    const size_t lanes = 16 / sizeof(T);
+    if (n < 2 * lanes)
+      return 1;
+    block_t acc = *reinterpret_cast<const block_t *>(a);
+    size_t i = lanes;
+    for (; i + lanes <= n; i += lanes)
+      OP::apply(acc, *reinterpret_cast<const block_t *>(a + i));
+    // Folded in the lane type too, converted back once
+    lane_t r = acc[0];
+    for (size_t l = 1; l < lanes; ++l)
+      OP::apply(r, acc[l]);
+    res = (T)r;
+    return i;
+  }
+};
+#endif // HLS_VECTOR_SIMD
+
 } // namespace details
 
 /// SIMD Vector of `N` elements of type `T`
@@ -98,12 +245,27 @@ public:
 #undef CONST_MEMBER
 
 protected:
+  template <typename, size_t> friend class vector;
+
   /// Pragma setter (hack until we support pragma on types)
   /// Note: must be used on all functions if possible
   INLINE NODEBUG void pragma() const {
     SYN_PRAGMA(HLS AGGREGATE variable=this)
   }
 
+  /// select(mask, *this, b), as a member to reach the pragma of the mask
+  INLINE vector blend(const vector<bool, N> &mask, const vector &b) const {
+    pragma();
+    mask.pragma();
+    b.pragma();
+    vector res;
+    for (size_t i = 0; i < N; ++i) {
+      SYN_PRAGMA(HLS UNROLL)
+      res[i] = mask[i] ? data[i] : b[i];
+    }
+    return res;
+  }
+
 public:
   /// Default constructor (trivial)
   vector() = default;
@@ -184,49 +346,130 @@ public:
 
 #undef INPLACE_POSTUNOP
 
-#define INPLACE_BINOP(OP)                                                      \
+#if HLS_VECTOR_SIMD
+#define SIMD_START(NAME)                                                       \
+  details::simd_inplace<details::simd_##NAME, T>::apply(data.data(),           \
+                                                        rhs.data.data(), N)
+#else
+#define SIMD_START(NAME) 0
+#endif
+
+#define INPLACE_BINOP(OP, NAME)                                                \
  INLINE vector &operator OP(const vector &rhs) {                       \
     pragma();                                                                  \
     rhs.pragma();                                                              \
-    for (size_t i = 0; i < N; ++i) {                                           \
+    for (size_t i = SIMD_START(NAME); i < N; ++i) {                            \
       SYN_PRAGMA(HLS UNROLL)                                                   \
       data[i] OP rhs[i];                                                       \
     }                                                                          \
     return *this;                                                              \
   }
 
-  INPLACE_BINOP(+=)
-  INPLACE_BINOP(-=)
-  INPLACE_BINOP(*=)
-  INPLACE_BINOP(/=)
-  INPLACE_BINOP(%=)
-  INPLACE_BINOP(&=)
-  INPLACE_BINOP(|=)
-  INPLACE_BINOP(^=)
-  INPLACE_BINOP(<<=)
-  INPLACE_BINOP(>>=)
+  INPLACE_BINOP(+=, add)
+  INPLACE_BINOP(-=, sub)
+  INPLACE_BINOP(*=, mul)
+  INPLACE_BINOP(/=, div)
+  INPLACE_BINOP(%=, mod)
+  INPLACE_BINOP(&=, and)
+  INPLACE_BINOP(|=, or)
+  INPLACE_BINOP(^=, xor)
+  INPLACE_BINOP(<<=, shl)
+  INPLACE_BINOP(>>=, shr)
 
 #undef INPLACE_BINOP
+#undef SIMD_START
 
-#define REDUCE_OP(NAME, OP)                                                    \
+#if HLS_VECTOR_SIMD
+#define SIMD_REDUCE_START(NAME, RES)                                           \
+  details::simd_reduce<details::simd_##NAME, T>::apply(data.data(), N, RES)
+#else
+#define SIMD_REDUCE_START(NAME, RES) 1
+#endif
+
+#define REDUCE_OP(NAME, OP, SIMD)                                              \
   INLINE T reduce_##NAME() const {                                             \
     pragma();                                                                  \
     T res = data[0];                                                           \
-    for (size_t i = 1; i < N; ++i) {                                           \
+    for (size_t i = SIMD_REDUCE_START(SIMD, res); i < N; ++i) {                \
       SYN_PRAGMA(HLS UNROLL)                                                   \
       res OP data[i];                                                          \
     }                                                                          \
     return res;                                                                \
   }
 
-  REDUCE_OP(add,  +=)
-  REDUCE_OP(mult, *=)
-  REDUCE_OP(and,  &=)
-  REDUCE_OP(or,   |=)
-  REDUCE_OP(xor,  ^=)
+  REDUCE_OP(add,  +=, add)
+  REDUCE_OP(mult, *=, mul)
+  REDUCE_OP(and,  &=, and)
+  REDUCE_OP(or,   |=, or)
+  REDUCE_OP(xor,  ^=, xor)
 
 #undef REDUCE_OP
 
+/// The first of the smallest (greatest) elements
+#define REDUCE_CMP(NAME, OP)                                                   \
+  INLINE T reduce_##NAME() const {                                             \
+    pragma();                                                                  \
+    T res = data[0];                                                           \
+    for (size_t i = SIMD_REDUCE_START(NAME, res); i < N; ++i) {                \
+      SYN_PRAGMA(HLS UNROLL)                                                   \
+      if (data[i] OP res)                                                      \
+        res = data[i];                                                         \
+    }                                                                          \
+    return res;                                                                \
+  }
+
+  REDUCE_CMP(min, <)
+  REDUCE_CMP(max, >)
+
+#undef REDUCE_CMP
+#undef SIMD_REDUCE_START
+
+  /// Vector of the elements at indices `I...`, such as
+  /// `v.shuffle<3, 2, 1, 0>()` to reverse a vector of 4 elements
+  template <size_t... I>
+  INLINE vector<T, sizeof...(I)> shuffle() const {
+    static_assert(details::indices_below<N, I...>::value,
+                  "shuffle index out of range");
+    pragma();
+    constexpr size_t idx[] = {I...};
+    vector<T, sizeof...(I)> res;
+    res.pragma();
+    for (size_t i = 0; i < sizeof...(I); ++i) {
+      SYN_PRAGMA(HLS UNROLL)
+      res[i] = data[idx[i]];
+    }
+    return res;
+  }
+
+  /// Loads element i from `src[idx[i]]`
+  template <typename I>
+  INLINE void gather(const T *src, const vector<I, N> &idx) {
+    pragma();
+    idx.pragma();
+    for (size_t i = 0; i < N; ++i) {
+      SYN_PRAGMA(HLS UNROLL)
+      data[i] = src[idx[i]];
+    }
+  }
+
+  /// Stores element i to `dst[idx[i]]`, the greatest i wins when indices
+  /// repeat
+  template <typename I>
+  INLINE void scatter(T *dst, const vector<I, N> &idx) const {
+    pragma();
+    idx.pragma();
+    for (size_t i = 0; i < N; ++i) {
+      SYN_PRAGMA(HLS UNROLL)
+      dst[idx[i]] = data[i];
+    }
+  }
+
+  /// Elementwise `mask[i] ? a[i] : b[i]`
+  INLINE friend vector select(const vector<bool, N> &mask, const vector &a,
+                              const vector &b) {
+    return a.blend(mask, b);
+  }
+
 #define LEXICO_OP(OP) \
   INLINE friend bool operator OP(const vector &lhs, const vector &rhs) {       \
     lhs.pragma();                                                              \
@@ -263,12 +506,23 @@ public:
 #undef LEXICO_OP
 #undef COMPARE_OP
 
+#if HLS_VECTOR_SIMD
+// The result is returned in place: GCC splits a by-value copy into scalar
+// lanes when the SIMD blocks access it with another lane type
+#define BINARY_OP(OP, INPLACE_OP)                                              \
+  INLINE friend vector operator OP(const vector &lhs, const vector &rhs) {     \
+    vector res = lhs;                                                          \
+    res INPLACE_OP rhs;                                                        \
+    return res;                                                                \
+  }
+#else
 #define BINARY_OP(OP, INPLACE_OP)                                              \
   INLINE friend vector operator OP(vector lhs, const vector &rhs) {            \
     lhs.pragma();                                                              \
     rhs.pragma();                                                              \
     return lhs INPLACE_OP rhs;                                                 \
   }
+#endif
 
   BINARY_OP(+, +=)
   BINARY_OP(-, -=)
@@ -0,0 +1,58 @@
+//
+// Throughput of hls::split::load_balance and hls::merge::load_balance
+// against the number of ports: the testbench feeds N worker tasks through
+// the split, and reads their results back through the merge.
+//
+//   make np-bench
+//   ./build/np_bench [elements] [work per element]
+//
+#include <hls_np_channel.h>
+#include <hls_task.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+static unsigned work = 0;
+
+static void worker(hls::stream<int>& in, hls::stream<int>& out) {
+    int v = in.read();
+    for (unsigned i = 0; i < work; ++i)
+        v = v * 1103515245 + 12345;
+    out.write(v);
+}
+
+template <unsigned N>
+static void run(long n) {
+    hls::split::load_balance<int, N> sp("sp");
+    hls::merge::load_balance<int, N> mg("mg");
+    hls::task_group group;
+    hls::task t[N];
+    for (unsigned i = 0; i < N; ++i)
+        t[i](worker, sp.out[i], mg.in[i]);
+
+    auto start = std::chrono::steady_clock::now();
+    // At most 64 elements in flight, like a bounded pipeline
+    long done = 0;
+    for (long i = 0; i < n; ++i) {
+        sp.in.write(i);
+        if (i >= 64) {
+            mg.out.read();
+            ++done;
+        }
+    }
+    for (; done < n; ++done)
+        mg.out.read();
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%2u ports: %6.2f M elements/s\n", N, n / s / 1e6);
+}
+
+int main(int argc, char** argv) {
+    long n = argc > 1 ? atol(argv[1]) : 200000;
+    work = argc > 2 ? atoi(argv[2]) : 0;
+    run<1>(n);
+    run<2>(n);
+    run<4>(n);
+    run<8>(n);
+    run<16>(n);
+    return 0;
+}
@@ -0,0 +1,125 @@
+//
+// hls::stream_of_blocks のテスト
+//
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
+#include <hls_streamofblocks.h>
+#include <hls_task.h>
+
+// 生存しているブロック数を数える
+struct block {
+    static std::atomic<int> live;
+    static std::atomic<int> peak;
+    int v[16];
+    block() {
+        int n = ++live;
+        for (int p = peak; n > p && !peak.compare_exchange_weak(p, n);) {}
+    }
+    ~block() { --live; }
+};
+std::atomic<int> block::live(0);
+std::atomic<int> block::peak(0);
+
+static void fast_reader(hls::stream_of_blocks<block>& in, hls::stream<int>& out) {
+    hls::read_lock<block> b(in);
+    out.write(((block&)b).v[0]);
+}
+
+static void slow_reader(hls::stream_of_blocks<block>& in, hls::stream<int>& out) {
+    hls::read_lock<block> b(in);
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+    out.write(((block&)b).v[0]);
+}
+
+static std::atomic<int> released(0);
+
+// 遅い読み手: ブロックを返す直前に released を数える
+static void counting_reader(hls::stream_of_blocks<block, 3>& in, hls::stream<const block*>& out) {
+    hls::read_lock<block> b(in);
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+    out.write(&(block&)b);
+    ++released;
+}
+
+// タスク実行中は、読み手が持っているものも含めて DEPTH 個までしか書けず、
+// ブロックは DEPTH + 1 個を使い回す
+static void test_depth_and_recycling() {
+    const int n = 500;
+    block::peak = 0;
+    released = 0;
+    std::set<const block*> seen;
+    {
+        hls::stream_of_blocks<block, 3> sob;
+        hls::stream<const block*> addrs("addrs");
+        hls::task_group group;
+        hls::task t(counting_reader, sob, addrs);
+        for (int i = 0; i < n; ++i) {
+            hls::write_lock<block> b(sob);
+            assert(i - released < 3);
+            ((block&)b).v[0] = i;
+        }
+        for (int i = 0; i < n; ++i)
+            seen.insert(addrs.read());
+    }
+    assert(block::live == 0);
+    assert(block::peak <= 3 + 1);
+    assert(seen.size() <= 3 + 1);
+}
+
+// 速度の違う読み手が全ブロックを順に受け取り、各ブロックは一度だけ解放される
+static void test_broadcast_readers() {
+    const int n = 500;
+    block::peak = 0;
+    {
+        hls::broadcast_stream_of_blocks<block, 2, 3> bc("bc");
+        hls::stream<int> fast_out("fast_out");
+        hls::stream<int> slow_out("slow_out");
+        hls::task_group group;
+        hls::task fast(fast_reader, bc.out[0], fast_out);
+        hls::task slow(slow_reader, bc.out[1], slow_out);
+        for (int i = 0; i < n; ++i) {
+            hls::write_lock<block> b(bc.in);
+            ((block&)b).v[0] = i;
+        }
+        for (int i = 0; i < n; ++i) {
+            assert(fast_out.read() == i);
+            assert(slow_out.read() == i);
+        }
+    }
+    assert(block::live == 0);
+    // 遅い読み手のポートの DEPTH 個と、書き込み中の 1 個
+    assert(block::peak <= 3 + 1);
+}
+
+// 読み手がブロックを持ったまま broadcast が破棄されても、解放は一度だけ
+static void test_broadcast_destroyed_while_read() {
+    auto* bc = new hls::broadcast_stream_of_blocks<block, 2>("bc_destroyed");
+    for (int i = 0; i < 2; ++i) {
+        hls::write_lock<block> b(bc->in);
+        ((block&)b).v[0] = i;
+    }
+    std::atomic<bool> locked(false);
+    int got = -1;
+    std::thread reader([&] {
+        hls::read_lock<block> b(bc->out[1]);
+        locked = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        got = ((block&)b).v[0];
+    });
+    while (!locked)
+        std::this_thread::yield();
+    delete bc;
+    reader.join();
+    assert(got == 0);
+    assert(block::live == 0);
+}
+
+int main() {
+    test_depth_and_recycling();
+    test_broadcast_readers();
+    test_broadcast_destroyed_while_read();
+    return 0;
+}
@@ -0,0 +1,169 @@
+//
+// hls::task のテスト
+// スレッド (既定)、HLS_TASK_POOL_SIM、HLS_TASK_COROUTINE_SIM のエンジンごとにビルドして実行する
+//
+#include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <hls_np_channel.h>
+#include <hls_streamofblocks.h>
+#include <hls_task.h>
+
+typedef int block_t[16];
+
+static void scale(hls::stream<int>& in, hls::stream<int>& out) {
+    out.write(in.read() * 3 + 1);
+}
+
+static void pack(hls::stream<int>& in, hls::stream_of_blocks<block_t>& out) {
+    hls::write_lock<block_t> b(out);
+    for (int i = 0; i < 16; ++i)
+        b[i] = in.read();
+}
+
+static void sum(hls::stream_of_blocks<block_t>& in, hls::stream<int>& out) {
+    hls::read_lock<block_t> b(in);
+    int s = 0;
+    for (int i = 0; i < 16; ++i)
+        s += b[i];
+    out.write(s);
+}
+
+static void mix(hls::stream<int>& in, hls::stream<int>& out) {
+    out.write(in.read() ^ 0x5a5a);
+}
+
+static void forward(hls::stream<int>& in, hls::stream<int>& out) {
+    out.write(in.read());
+}
+
+// 値によって処理時間が変わるワーカー
+static void square(hls::stream<int>& in, hls::stream<int>& out) {
+    int v = in.read();
+#ifndef HLS_TASK_COROUTINE_SIM
+    std::this_thread::sleep_for(std::chrono::microseconds((v % 3) * 100));
+#endif
+    out.write(v * v);
+}
+
+// stream -> stream_of_blocks -> split/merge::load_balance のパイプラインが
+// どのエンジンでも同じ結果になる
+static void test_pipeline() {
+    const int blocks = 40;
+    std::vector<int> expected;
+    for (int k = 0; k < blocks; ++k) {
+        int s = 0;
+        for (int i = 0; i < 16; ++i)
+            s += (k * 16 + i) * 3 + 1;
+        expected.push_back(s);
+    }
+
+    hls::stream<int> in("in"), scaled("scaled"), sums("sums");
+    hls::stream_of_blocks<block_t> packed;
+    hls::split::load_balance<int, 3> sp("sp");
+    hls::merge::load_balance<int, 3> mg("mg");
+    hls::task_group group;
+    hls::task t1(scale, in, scaled);
+    hls::task t2(pack, scaled, packed);
+    hls::task t3(sum, packed, sums);
+    hls::task t4(forward, sums, sp.in);
+    hls::task w[3];
+    for (int i = 0; i < 3; ++i)
+        w[i](mix, sp.out[i], mg.in[i]);
+
+    for (int i = 0; i < blocks * 16; ++i)
+        in.write(i);
+    // load_balance は順序を保たない
+    std::vector<int> got;
+    for (int k = 0; k < blocks; ++k)
+        got.push_back(mg.out.read() ^ 0x5a5a);
+    std::sort(got.begin(), got.end());
+    std::sort(expected.begin(), expected.end());
+    assert(got == expected);
+}
+
+// split::in_order / merge::in_order は入力順に結果を返す
+static void test_in_order() {
+    const int n = 300;
+    hls::split::in_order<int, 4> sp("io_split");
+    hls::merge::in_order<int, 4> mg(sp, "io_merge");
+    hls::task_group group;
+    hls::task w[4];
+    for (int i = 0; i < 4; ++i)
+        w[i](square, sp.out[i], mg.in[i]);
+    for (int i = 0; i < n; ++i)
+        sp.in.write(i);
+    for (int i = 0; i < n; ++i)
+        assert(mg.out.read() == i * i);
+}
+
+// どこからも書かれないストリームを読むとデッドロックが報告されて abort する
+static void test_deadlock_reported() {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        dup2(fds[1], 1);
+        close(fds[0]);
+        alarm(20);
+        hls::stream<int> never("never_written"), out("out");
+        hls::task t(forward, never, out);
+        out.read();
+        _exit(0);
+    }
+    close(fds[1]);
+    std::string output;
+    char buf[256];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0)
+        output.append(buf, n);
+    close(fds[0]);
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+    assert(output.find("deadlock detected") != std::string::npos);
+    assert(output.find("never_written") != std::string::npos);
+}
+
+#ifndef HLS_TASK_COROUTINE_SIM
+// タスクではないスレッドが、合わせてタイムアウトより長くかけて書き込む:
+// 書き込みの間隔がタイムアウトより短ければデッドロックではない
+// (コルーチンエンジンではこの使い方はできない)
+static void test_thread_producer() {
+    const int n = 10;
+    hls::stream<int> in("thread_in"), out("thread_out");
+    hls::task_group group;
+    hls::task t(forward, in, out);
+    std::thread producer([&] {
+        for (int i = 0; i < n; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(40));
+            in.write(i);
+        }
+    });
+    for (int i = 0; i < n; ++i)
+        assert(out.read() == i);
+    producer.join();
+}
+#endif
+
+int main() {
+    // 既定の 1 秒では時間がかかるので、デッドロック判定を 100 ms にする
+    setenv("HLS_STREAM_DEADLOCK_TIMEOUT", "100", 1);
+    // fork はスレッドを作る前に行う
+    test_deadlock_reported();
+    test_pipeline();
+    test_in_order();
+#ifndef HLS_TASK_COROUTINE_SIM
+    test_thread_producer();
+#endif
+    return 0;
+}
@@ -0,0 +1,186 @@
+//
+// hls::vector のテスト
+// SIMD 版と HLS_VECTOR_NO_SIMD 版をビルドし、スカラーの計算と比べる。
+// 結果のチェックサムを出力するので、両者の出力は一致する
+//
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits>
+#include <type_traits>
+#include <hls_vector.h>
+
+static uint64_t checksum = 0;
+
+template <typename T>
+static void add_checksum(const T& v) {
+    unsigned char b[sizeof(T)];
+    memcpy(b, &v, sizeof(T));
+    for (unsigned i = 0; i < sizeof(T); ++i)
+        checksum = checksum * 1099511628211ull ^ b[i];
+}
+
+template <typename T, size_t N>
+static void check(const hls::vector<T, N>& v, const T (&expected)[N]) {
+    for (size_t i = 0; i < N; ++i) {
+        assert(v[i] == expected[i]);
+        add_checksum(v[i]);
+    }
+}
+
+// 桁あふれする値を含む擬似乱数
+static uint64_t seed = 1;
+template <typename T>
+static T random_value() {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    uint64_t r = seed >> 11;
+    if (std::numeric_limits<T>::is_integer) {
+        T v;
+        memcpy(&v, &r, sizeof(T));
+        return v;
+    }
+    return T(int64_t(r % 2001) - 1000) / T(8);
+}
+
+// 符号付き整数の桁あふれは未定義なので、期待値は符号なしで計算する
+// (int より狭い型は int に昇格するので unsigned で計算する)
+template <typename T, bool = std::is_integral<T>::value>
+struct wrapping { typedef T type; };
+template <typename T>
+struct wrapping<T, true> { typedef typename std::make_unsigned<decltype(T() + T())>::type type; };
+
+#define CHECK_OP(OP, U)                                                        \
+    {                                                                          \
+        T e[N];                                                                \
+        for (size_t i = 0; i < N; ++i)                                         \
+            e[i] = T(U(a[i]) OP U(b[i]));                                      \
+        check(a OP b, e);                                                      \
+        hls::vector<T, N> c = a;                                               \
+        c OP##= b;                                                             \
+        check(c, e);                                                           \
+    }
+
+template <typename T, size_t N>
+static void test_arith() {
+    typedef typename wrapping<T>::type W;
+    hls::vector<T, N> a, b;
+    for (size_t i = 0; i < N; ++i) {
+        a[i] = random_value<T>();
+        b[i] = random_value<T>();
+        if (b[i] == T(0))
+            b[i] = T(3);
+    }
+    CHECK_OP(+, W)
+    CHECK_OP(-, W)
+    CHECK_OP(*, W)
+    CHECK_OP(/, T)
+
+    hls::vector<bool, N> mask;
+    for (size_t i = 0; i < N; ++i)
+        mask[i] = a[i] < b[i];
+    T e[N];
+    for (size_t i = 0; i < N; ++i)
+        e[i] = mask[i] ? a[i] : b[i];
+    check(select(mask, a, b), e);
+
+    // 整数では加算と乗算の順序で結果は変わらない。浮動小数点では
+    // 要素の順に畳み込んだ結果と一致しなければならない
+    T sum = a[0], prod = a[0], mn = a[0], mx = a[0];
+    for (size_t i = 1; i < N; ++i) {
+        sum = T(W(sum) + W(a[i]));
+        prod = T(W(prod) * W(a[i]));
+        if (a[i] < mn)
+            mn = a[i];
+        if (a[i] > mx)
+            mx = a[i];
+    }
+    assert(a.reduce_add() == sum);
+    assert(a.reduce_mult() == prod);
+    assert(a.reduce_min() == mn);
+    assert(a.reduce_max() == mx);
+    add_checksum(sum);
+    add_checksum(prod);
+    add_checksum(mn);
+    add_checksum(mx);
+}
+
+template <typename T, size_t N>
+static void test_integer() {
+    typedef typename wrapping<T>::type W;
+    test_arith<T, N>();
+
+    hls::vector<T, N> a, b;
+    for (size_t i = 0; i < N; ++i) {
+        a[i] = random_value<T>();
+        b[i] = random_value<T>();
+        // INT_MIN % -1 を避ける
+        if (b[i] == T(0) || b[i] == T(-1))
+            b[i] = T(7);
+    }
+    CHECK_OP(%, T)
+    CHECK_OP(&, T)
+    CHECK_OP(|, T)
+    CHECK_OP(^, T)
+
+    for (size_t i = 0; i < N; ++i)
+        b[i] = T(i % (sizeof(T) * 8));
+    CHECK_OP(<<, W)
+    CHECK_OP(>>, T)
+
+    T and_ = a[0], or_ = a[0], xor_ = a[0];
+    for (size_t i = 1; i < N; ++i) {
+        and_ &= a[i];
+        or_ |= a[i];
+        xor_ ^= a[i];
+    }
+    assert(a.reduce_and() == and_);
+    assert(a.reduce_or() == or_);
+    assert(a.reduce_xor() == xor_);
+    add_checksum(and_);
+    add_checksum(or_);
+    add_checksum(xor_);
+}
+
+#undef CHECK_OP
+
+// 最大値・最小値で必ず桁あふれする
+template <typename T>
+static void test_overflow() {
+    typedef typename wrapping<T>::type W;
+    const T max = std::numeric_limits<T>::max();
+    const T min = std::numeric_limits<T>::min();
+    hls::vector<T, 8> a(max), b(T(1));
+    hls::vector<T, 8> s = a + b;
+    hls::vector<T, 8> d = hls::vector<T, 8>(min) - b;
+    T sum = max;
+    for (size_t i = 0; i < 8; ++i) {
+        assert(s[i] == min);
+        assert(d[i] == max);
+        if (i > 0)
+            sum = T(W(sum) + W(max));
+    }
+    assert(a.reduce_add() == sum);
+}
+
+int main() {
+    test_integer<int8_t, 16>();
+    test_integer<int8_t, 64>();
+    test_integer<uint8_t, 32>();
+    test_integer<int16_t, 16>();
+    test_integer<uint16_t, 12>();
+    test_integer<int32_t, 8>();
+    test_integer<int32_t, 7>();
+    test_integer<uint32_t, 16>();
+    test_integer<int64_t, 4>();
+    test_integer<int64_t, 16>();
+    test_arith<float, 16>();
+    test_arith<float, 5>();
+    test_arith<double, 8>();
+    test_overflow<int8_t>();
+    test_overflow<int16_t>();
+    test_overflow<int32_t>();
+    test_overflow<int64_t>();
+    printf("checksum %016llx\n", (unsigned long long)checksum);
+    return 0;
+}